@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2019 Nutanix Inc. All rights reserved.
+ *
+ * Author: Felipe Franciosi <felipe@nutanix.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Measures the cost of calls through each kind of stub. Runs with
+ * libbench_stub.so preloaded (see larmier_bench.c):
+ *
+ *   bench_calls [ <iterations> ]
+ *
+ * Each stub is timed in these modes:
+ *   direct: the real function is called directly, for reference.
+ *   off:    stubbing is off, so the stub passes the call through.
+ *   real:   stubbing is on and the bca has the stub make the real call.
+ *   inject: stubbing is on and the bca has the stub inject its failure.
+ *
+ * The bca is set up here rather than by larmier, and rewound every BATCH
+ * calls so it never needs to grow.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "larmier.h"
+
+#define ITERATIONS  1000000
+#define BATCH       1024
+
+typedef enum bench_mode {
+    MODE_DIRECT = 0,
+    MODE_OFF,
+    MODE_REAL,
+    MODE_INJECT,
+    MODE_MAX,
+} bench_mode_t;
+
+static const char *mode_names[MODE_MAX] = {
+    "direct", "off", "real", "inject",
+};
+
+static bca_t *bca;
+static volatile int sink;       // Keeps calls to pure functions
+
+static int (*real_atoi)(const char *);
+static int (*real_sprintf)(char *, const char *, ...);
+static void *(*real_calloc)(size_t, size_t);
+
+static void
+call_atoi(void)
+{
+    sink = atoi("1");
+}
+
+static void
+direct_atoi(void)
+{
+    sink = real_atoi("1");
+}
+
+static void
+call_sprintf(void)
+{
+    char buf[16];
+
+    (void)sprintf(buf, "%d", 1);
+}
+
+static void
+direct_sprintf(void)
+{
+    char buf[16];
+
+    (void)real_sprintf(buf, "%d", 1);
+}
+
+static void
+call_calloc(void)
+{
+    free(calloc(1, 16));
+}
+
+static void
+direct_calloc(void)
+{
+    free(real_calloc(1, 16));
+}
+
+static const struct {
+    const char *macro;
+    const char *func;
+    void (*call)(void);
+    void (*direct)(void);
+} benches[] = {
+    { "_LSDEFn",        "atoi",     call_atoi,      direct_atoi },
+    { "_LSDEFv",        "sprintf",  call_sprintf,   direct_sprintf },
+    { "LSDEF_calloc",   "calloc",   call_calloc,    direct_calloc },
+};
+
+static inline uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Returns the average time per call, in ns.
+static double
+bench_run(void (*call)(void), bench_mode_t mode, long iterations)
+{
+    uint64_t start;
+    long i, j;
+
+    larmier_stub(mode == MODE_REAL || mode == MODE_INJECT);
+
+    start = now_ns();
+    for (i = 0; i < iterations; i += BATCH) {
+        (void)memset(bca->map, (mode == MODE_REAL) ? 0xFF : 0,
+                     BCA_BYTES(BATCH));
+        bca->count = 0;
+        for (j = 0; j < BATCH; j++) {
+            call();
+        }
+    }
+
+    larmier_stub(false);
+
+    return (double)(now_ns() - start) / (i > 0 ? i : 1);
+}
+
+static int
+bca_setup(void)
+{
+    char name[NAME_MAX];
+    int fd;
+
+    (void)snprintf(name, sizeof(name), "/larmier_bench.%d", (int)getpid());
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        perror("shm_open");
+        return -1;
+    }
+    if (ftruncate(fd, LARMIER_LEN) == -1) {
+        perror("ftruncate");
+        goto err;
+    }
+    bca = mmap(NULL, LARMIER_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (bca == MAP_FAILED) {
+        perror("mmap");
+        goto err;
+    }
+    bca->size = LARMIER_LEN;
+    bca->prefix = BATCH;
+    (void)close(fd);
+
+    // The stubs attach on their first call, after which it can go.
+    (void)setenv(LARMIER_BCA, name, 1);
+    call_atoi();
+    (void)shm_unlink(name);
+
+    return 0;
+
+err:
+    (void)close(fd);
+    (void)shm_unlink(name);
+    return -1;
+}
+
+int
+main(int argc, char **argv)
+{
+    long iterations = ITERATIONS;
+    void *libc;
+    bench_mode_t mode;
+    size_t i;
+    double ns;
+
+    if (argc > 1) {
+        iterations = strtol(argv[1], NULL, 10);
+    }
+    if (iterations < BATCH) {
+        iterations = BATCH;
+    }
+
+    libc = dlopen("libc.so.6", RTLD_NOW | RTLD_NOLOAD);
+    if (libc == NULL) {
+        fprintf(stderr, "dlopen: %s\n", dlerror());
+        return EXIT_FAILURE;
+    }
+    real_atoi = dlsym(libc, "atoi");
+    real_sprintf = dlsym(libc, "sprintf");
+    real_calloc = dlsym(libc, "calloc");
+    if (real_atoi == NULL || real_sprintf == NULL || real_calloc == NULL) {
+        fprintf(stderr, "dlsym: %s\n", dlerror());
+        return EXIT_FAILURE;
+    }
+
+    if (bca_setup() == -1) {
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        for (mode = 0; mode < MODE_MAX; mode++) {
+            ns = bench_run((mode == MODE_DIRECT) ? benches[i].direct :
+                                                   benches[i].call,
+                           mode, iterations);
+            printf("calls macro=%s func=%s mode=%s iterations=%ld ns=%.2f\n",
+                   benches[i].macro, benches[i].func, mode_names[mode],
+                   iterations, ns);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2019 Nutanix Inc. All rights reserved.
+ *
+ * Author: Felipe Franciosi <felipe@nutanix.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Stubs for the benchmarks, one through each kind of stub definition:
+ * atoi() through _LSDEFn, sprintf() through _LSDEFv and calloc().
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "larmier_stub.h"
+
+LSDEF(int, atoi, const char *, nptr)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+LSDEFv(int, sprintf, vsprintf, char *, str, const char *, format, ...)
+{
+    errno = EOVERFLOW;
+    return -1;
+}
+
+LSDEF_calloc()
+{
+    errno = ENOMEM;
+    return NULL;
+}
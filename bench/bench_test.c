@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2019 Nutanix Inc. All rights reserved.
+ *
+ * Author: Felipe Franciosi <felipe@nutanix.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * A synthetic test for larmier_bench:
+ *
+ *   bench_test <calls> <depth> <output>
+ *
+ * Makes <calls> stubbed calls. The test carries on past failures of the first
+ * <depth> of them, and gives up on failures of any after those, so exploring
+ * it takes 2^depth * (calls - depth + 1) paths. Every path writes <output>
+ * bytes to stdout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "larmier.h"
+
+int
+main(int argc, char **argv)
+{
+    char buf[64];
+    long calls, depth, output;
+    long i;
+    void *ptr;
+
+    if (argc != 4) {
+        fprintf(stderr, "Usage: %s <calls> <depth> <output>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    calls = strtol(argv[1], NULL, 10);
+    depth = strtol(argv[2], NULL, 10);
+    output = strtol(argv[3], NULL, 10);
+
+    larmier_stub(true);
+
+    // Cycle through the stubs, so all of them are exercised.
+    for (i = 0; i < calls; i++) {
+        switch (i % 3) {
+        case 0:
+            if (atoi("1") == 1) {
+                continue;
+            }
+            break;
+        case 1:
+            if (sprintf(buf, "%ld", i) > 0) {
+                continue;
+            }
+            break;
+        case 2:
+            ptr = calloc(1, sizeof(buf));
+            if (ptr != NULL) {
+                free(ptr);
+                continue;
+            }
+            break;
+        }
+        if (i >= depth) {
+            break;
+        }
+    }
+
+    larmier_stub(false);
+
+    (void)memset(buf, 'x', sizeof(buf));
+    for (i = 0; i < output; i += sizeof(buf)) {
+        (void)fwrite(buf, 1, (output - i < (long)sizeof(buf)) ?
+                             output - i : (long)sizeof(buf), stdout);
+    }
+
+    return EXIT_SUCCESS;
+}
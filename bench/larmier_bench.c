@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2019 Nutanix Inc. All rights reserved.
+ *
+ * Author: Felipe Franciosi <felipe@nutanix.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Benchmarks larmier end to end, and the cost of calls through stubs. Runs
+ * from the build directory of bench/ (see the larmier_bench target):
+ *
+ *   larmier_bench -L <larmier> [ -b <backend> ... ] [ -c <calls> ]
+ *                 [ -d <depth> ] [ -o <output> ] [ -r <runs> ]
+ *                 [ -n <iterations> ]
+ *
+ * Results go to stdout, one per line, as a kind followed by key=value pairs
+ * in a fixed order. Anything else (eg. skipped backends) goes to stderr.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BACKENDS_MAX    8
+#define STUBSLIB        "./libbench_stub.so"
+
+static const char *default_backends[] = {
+    "none", "track", "sanitizer", "valgrind",
+};
+
+static const struct {
+    const char *name;
+    const char *flag;
+} modes[] = {
+    { "exec",       NULL },
+    { "forksrv",    "-f" },
+    { "explore",    "-x" },
+};
+
+static inline uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Runs a command with its output discarded, returning its exit status.
+static int
+run(char **argv)
+{
+    int status;
+    pid_t pid;
+
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        if (freopen("/dev/null", "w", stdout) == NULL ||
+            freopen("/dev/null", "w", stderr) == NULL) {
+            _exit(EXIT_FAILURE);
+        }
+        (void)execv(argv[0], argv);
+        _exit(EXIT_FAILURE);
+    }
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("waitpid");
+        return -1;
+    }
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static long
+count_lines(const char *name)
+{
+    FILE *stream;
+    long lines = 0;
+    int c;
+
+    stream = fopen(name, "r");
+    if (stream == NULL) {
+        return -1;
+    }
+    while ((c = fgetc(stream)) != EOF) {
+        lines += (c == '\n');
+    }
+    (void)fclose(stream);
+
+    return lines;
+}
+
+// Explore bench_test with a backend in each mode, keeping the best of 'runs'.
+static void
+bench_paths(char *larmier, char *backend, char **test_args, int runs,
+            char *report)
+{
+    char *test = (strcmp(backend, "sanitizer") == 0) ? "./bench_test_asan" :
+                                                       "./bench_test";
+    char *argv[16];
+    uint64_t best, start, elapsed;
+    long paths = 0;
+    size_t m;
+    int i, n, r;
+
+    if (access(test, X_OK) == -1) {
+        fprintf(stderr, "Skipping backend %s: no %s\n", backend, test);
+        return;
+    }
+
+    for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        n = 0;
+        argv[n++] = larmier;
+        argv[n++] = "-b";
+        argv[n++] = backend;
+        if (modes[m].flag != NULL) {
+            argv[n++] = (char *)modes[m].flag;
+        }
+        argv[n++] = "--report";
+        argv[n++] = report;
+        argv[n++] = "-l";
+        argv[n++] = STUBSLIB;
+        argv[n++] = test;
+        for (i = 0; i < 3; i++) {
+            argv[n++] = test_args[i];
+        }
+        argv[n] = NULL;
+
+        best = UINT64_MAX;
+        for (r = 0; r < runs; r++) {
+            start = now_ns();
+            if (run(argv) != 0) {
+                fprintf(stderr, "Skipping backend %s: larmier failed\n",
+                        backend);
+                return;
+            }
+            elapsed = now_ns() - start;
+            if (elapsed < best) {
+                best = elapsed;
+            }
+        }
+        paths = count_lines(report);
+
+        printf("paths backend=%s mode=%s calls=%s depth=%s output=%s "
+               "paths=%ld sec=%.3f paths_per_sec=%.1f\n", backend,
+               modes[m].name, test_args[0], test_args[1], test_args[2], paths,
+               (double)best / 1e9, paths / ((double)best / 1e9));
+        (void)fflush(stdout);
+    }
+}
+
+// Time calls through the stubs, in a process of their own.
+static int
+bench_calls(char *iterations)
+{
+    char *argv[] = { "./bench_calls", iterations, NULL };
+    int status;
+    pid_t pid;
+
+    (void)fflush(stdout);
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        (void)setenv("LD_PRELOAD", STUBSLIB, 1);
+        (void)execv(argv[0], argv);
+        perror("execv");
+        _exit(EXIT_FAILURE);
+    }
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("waitpid");
+        return -1;
+    }
+
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+static void
+usage(char *argv0)
+{
+    fprintf(stderr, "Usage: %s -L <larmier> [ -b <backend> ... ] "
+            "[ -c <calls> ] [ -d <depth> ]\n", argv0);
+    fprintf(stderr, "       [ -o <output> ] [ -r <runs> ] "
+            "[ -n <iterations> ]\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    char *backends[BACKENDS_MAX];
+    char *test_args[3] = { "9", "3", "4096" };
+    char *iterations = "1000000";
+    char *larmier = NULL;
+    char report[] = "/tmp/larmier_bench.XXXXXX";
+    int nbackends = 0;
+    int runs = 1;
+    int ret = EXIT_SUCCESS;
+    int opt;
+    int fd;
+    int i;
+
+    while ((opt = getopt(argc, argv, "L:b:c:d:o:r:n:")) != -1) {
+        switch (opt) {
+        case 'L':
+            larmier = optarg;
+            break;
+        case 'b':
+            if (nbackends == BACKENDS_MAX) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            backends[nbackends++] = optarg;
+            break;
+        case 'c':
+            test_args[0] = optarg;
+            break;
+        case 'd':
+            test_args[1] = optarg;
+            break;
+        case 'o':
+            test_args[2] = optarg;
+            break;
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        case 'n':
+            iterations = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (larmier == NULL || runs < 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (nbackends == 0) {
+        for (i = 0; i < (int)(sizeof(default_backends) /
+                              sizeof(default_backends[0])); i++) {
+            backends[nbackends++] = (char *)default_backends[i];
+        }
+    }
+
+    fd = mkstemp(report);
+    if (fd == -1) {
+        perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+    (void)close(fd);
+
+    for (i = 0; i < nbackends; i++) {
+        bench_paths(larmier, backends[i], test_args, runs, report);
+    }
+    (void)unlink(report);
+
+    if (bench_calls(iterations) == -1) {
+        ret = EXIT_FAILURE;
+    }
+
+    return ret;
+}
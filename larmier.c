@@ -14,43 +14,64 @@
  *
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
- *
- * TODO:
- *  Print injected error backtrace on leak detection.
- *  Support more than one error value per stub.
- *  Grow BCA dynamically.
- *  Allow BCA start point to be specified on command line.
- *  Investigate multi-threaded programs.
  */
 
 #define _GNU_SOURCE
 #include <assert.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
 #include <libgen.h>
+#include <limits.h>
+#include <link.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "larmier.h"
+#include "liblarmier.h"
 
 #define VERSION "20190201.001"
 
-#define EXIT_MASK_TEST      0x100
-#define EXIT_MASK_SYSTEM    0x200
+#define EXIT_MASK_TEST      LARMIER_RESULT_TEST
+#define EXIT_MASK_SYSTEM    LARMIER_RESULT_SYSTEM
 #define EXIT_MASK           (EXIT_MASK_TEST | EXIT_MASK_SYSTEM)
 
-#define EXIT_ERR_ABNORMAL   0xFB
-#define EXIT_ERR_FDLEAKS    0xFC
-#define EXIT_ERR_LARMIER    0xFD
-#define EXIT_ERR_VALGRIND   0xFE
+#define EXIT_ERR_TIMEOUT    LARMIER_FAIL_TIMEOUT
+#define EXIT_ERR_ABNORMAL   LARMIER_FAIL_ABNORMAL
+#define EXIT_ERR_FDLEAKS    LARMIER_FAIL_FDLEAKS
+#define EXIT_ERR_LARMIER    LARMIER_EXIT_ERR
+#define EXIT_ERR_VALGRIND   LARMIER_FAIL_VALGRIND
+
+#define EXIT_NOT_RUN        (EXIT_MASK_SYSTEM | EXIT_ERR_LARMIER)
 
-#define READBUF_SIZE        4096    // Initial buffer for pipe reading
+#define TRACKLIB            "liblarmier_track.so"
+
+#define READBUF_SIZE        4096    // Chunk for pipe reading
+#define LOGLINE_MAX         1024    // Longer valgrind log lines are truncated
+#define VALGRIND_LOG_FD     197     // Where valgrind writes its log
+#define JOBS_MAX            1024    // Maximum number of parallel workers
+#define CHECKPOINT_INTERVAL 60      // Seconds between checkpoints
+#define CHECKPOINT_HEADER   "larmier checkpoint"
+#define CACHE_SIZE          64      // Default result cache size, in MiB
+#define PROF_SUB_BITS       3       // Histogram buckets per power of two, log2
+#define PROF_BUCKETS        (64 << PROF_SUB_BITS)
+#define HASH_BASIS          0xcbf29ce484222325ULL   // 64-bit FNV-1a
+#define HASH_PRIME          0x100000001b3ULL
 
 #define PERR(...) fprintf(stderr, __VA_ARGS__)
 #define POUT(...) fprintf(stdout, __VA_ARGS__)
@@ -58,15 +79,178 @@
 typedef struct bca_ctx {
     char *bca_name;
     bca_t *bca;
+    size_t bca_len;             // Bytes mapped, the test may have grown more
 } bca_ctx_t;
 
+// A copy of the bca map left by a run. Every path queued off the run shares
+// it, so queueing a path doesn't copy a (potentially very long) prefix.
+typedef struct larmier_snap {
+    unsigned int refs;
+    uint32_t len;
+    uint8_t map[];
+} larmier_snap_t;
+
+// A BCA prefix that still needs exploring. Calls beyond 'len' are failed.
+// The prefix is taken from 'snap', except for its last call set to 'last'.
+typedef struct larmier_path {
+    larmier_snap_t *snap;
+    uint32_t len;
+    unsigned int last;
+    bool seed;                  // Siblings of the whole prefix are pending
+} larmier_path_t;
+
+// Paths discovered by a worker. The owner pops from the tail (depth first),
+// idle workers steal from the head (the shallowest, hence largest, subtree).
+typedef struct path_deque {
+    larmier_path_t **paths;
+    size_t head;
+    size_t tail;
+    size_t size;
+} path_deque_t;
+
+typedef struct larmier_worker {
+    bca_ctx_t *bca_ctx;
+    path_deque_t deque;
+    larmier_path_t *path;       // Path being explored, NULL if idle
+    pid_t pid;                  // Valgrind (or fork server), zero if none
+    int pipefd;                 // Test output
+    int logfd;                  // Valgrind log, -1 if none
+    int ctlfd;                  // Fork server commands, -1 if none
+    int stfd;                   // Fork server path statuses, -1 if none
+    int spool;                  // Output (and log) of the current path
+    char line[LOGLINE_MAX];     // Valgrind log line being received
+    size_t line_len;
+    unsigned int fd_leaks;      // Reported by valgrind for the current path
+    bool mc_error;              // Memcheck is reporting an error
+    bool mc_abort;              // Memcheck reported an error, kill the path
+    bool timed_out;             // The path was killed for taking too long
+    uint64_t start;             // When the current path started, in ns
+    uint64_t ready;             // When it was spawned
+    uint64_t output;            // When it first wrote something, zero if not
+    uint64_t exit;              // When it exited
+    uint64_t drain;             // Time spent draining its output and log
+    struct rusage rusage;       // Of the current path, once it exited
+} larmier_worker_t;
+
+// Where the time of each path goes, see prof_path().
+typedef enum larmier_phase {
+    PHASE_SPAWN = 0,            // Loading the bca and starting the test
+    PHASE_STARTUP,              // Until the test first writes something
+    PHASE_RUN,                  // Until the test exits
+    PHASE_DRAIN,                // Reading output and parsing valgrind's log
+    PHASE_COMPLETE,             // Classifying the path and queueing siblings
+    PHASE_MAX,
+} larmier_phase_t;
+
+static const char *phase_names[PHASE_MAX] = {
+    "spawn", "startup", "run", "drain", "complete",
+};
+
+// A function of the test program, to look up backtraces with.
+typedef struct elf_sym {
+    uint64_t addr;
+    uint64_t size;
+    char *name;
+} elf_sym_t;
+
+// A histogram of durations in ns, with PROF_SUB_BITS of precision.
+typedef struct prof_hist {
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+    uint64_t buckets[PROF_BUCKETS];
+} prof_hist_t;
+
+typedef struct larmier_ctx {
+    larmier_worker_t *workers;
+    int nworkers;
+    int busy;
+    int *slots;                 // Left in a pool shared with others, or NULL
+    larmier_path_t *fail;       // First failing path in DFS order
+    int fail_err;
+    int fail_spool;             // Output of the failing path, -1 if none
+    bca_trace_t fail_traces[BCA_RING];  // Of its injections, by call
+    unsigned int fail_ntraces;
+    elf_sym_t *syms;            // Of the test, loaded when first needed
+    size_t nsyms;
+    bool syms_loaded;
+    int final_err;              // Exit status of the path with no injections
+    int shard;
+    int shards;
+    FILE *report;               // Per-path records, NULL if not asked for
+    larmier_result_cb_t result_cb;  // Per-path callback, NULL if none
+    void *result_data;
+    FILE *trace;                // Trace events, NULL if not asked for
+    bool trace_sep;             // An event was written, separate the next
+    uint64_t epoch;             // When the exploration started, in ns
+    uint64_t deadline;          // When to give up exploring, zero if never
+    bool expired;               // The deadline passed
+    uint64_t pruned;            // Calls not failed again, see --dedup
+    prof_hist_t prof[PHASE_MAX];
+} larmier_ctx_t;
+
+// How tests are checked for memory errors and leaks.
+typedef enum larmier_backend {
+    BACKEND_VALGRIND = 0,       // Run under valgrind's memcheck (default)
+    BACKEND_NONE,               // Run natively, only check exit statuses
+    BACKEND_SANITIZER,          // Run a test built with ASan/LSan natively
+    BACKEND_TRACK,              // Run natively with the built-in leak tracker
+} larmier_backend_t;
+
 typedef struct larmier_opts {
-    char **valgrind_argv;
+    char **test_argv;
+    char *test;                 // Test program, within test_argv
+    larmier_backend_t backend;
+    char *valgrind;             // NULL unless the backend is valgrind
     char *stubsdir;
     char *stubslib;
+    char *tracklib;
     int debug;
+    int jobs;
+    bool forksrv;
+    bool explore;
+    bool early_abort;
+    bool dedup;
+    int streams;                // Of calls, one per thread, see bca_t
+    int shard;
+    int shards;
+    char *checkpoint;
+    char *resume;
+    char *start;
+    char *cache;
+    size_t cache_size;          // In bytes
+    char *report;
+    char *trace;
+    uint64_t path_timeout;      // In ns, zero if none
+    uint64_t timeout;           // In ns, zero if none
+    char *batch;                // Manifest of tests to explore, see --batch
 } larmier_opts_t;
 
+// Explorations run with a set of opts, see liblarmier.h.
+struct larmier {
+    larmier_opts_t *opts;
+    bca_ctx_t **bca_ctxs;       // One per worker, created when first needed
+};
+
+// A test explored as part of a --batch.
+typedef struct batch_entry {
+    larmier_t *larmier;
+    larmier_ctx_t *ctx;         // NULL once its verdict is known
+    struct pollfd *pfds;        // Polled for its workers, NULL if not
+    unsigned int line;          // Of the manifest
+    int err;
+} batch_entry_t;
+
+// An entry of the result cache, see cache_evict().
+typedef struct cache_file {
+    char name[17];
+    off_t size;
+    struct timespec mtime;
+} cache_file_t;
+
+// Set when asked to stop, so the exploration can be checkpointed first.
+static volatile sig_atomic_t larmier_stop;
+
 static inline int
 setup_pipe(int pipefd)
 {
@@ -90,10 +274,93 @@ setup_pipe(int pipefd)
     return 0;
 }
 
+static inline bool
+has_ctl(larmier_opts_t *larmier_opts)
+{
+    return (larmier_opts->forksrv || larmier_opts->explore);
+}
+
+// Tests lead a process group when all of their processes may need killing.
+static inline bool
+has_pgrp(larmier_opts_t *larmier_opts)
+{
+    return (has_ctl(larmier_opts) || larmier_opts->path_timeout > 0 ||
+            larmier_opts->timeout > 0);
+}
+
+static inline int
+setup_ctl(int ctlfd, int stfd)
+{
+    // Move both pipes out of the way before placing them.
+    ctlfd = fcntl(ctlfd, F_DUPFD, LARMIER_ST_FD + 1);
+    stfd = fcntl(stfd, F_DUPFD, LARMIER_ST_FD + 1);
+    if (ctlfd == -1 || stfd == -1) {
+        perror("fcntl");
+        return -1;
+    }
+
+    if (dup2(ctlfd, LARMIER_CTL_FD) == -1 || dup2(stfd, LARMIER_ST_FD) == -1) {
+        perror("dup2");
+        return -1;
+    }
+    (void)close(ctlfd);
+    (void)close(stfd);
+
+    return 0;
+}
+
+static inline int
+setup_log(int logfd)
+{
+    // Valgrind is told to log to VALGRIND_LOG_FD (see test_argv_setup()).
+    if (dup2(logfd, VALGRIND_LOG_FD) == -1) {
+        perror("dup2");
+        return -1;
+    }
+    (void)close(logfd);
+
+    return 0;
+}
+
+// Fill in LD_PRELOAD and LD_LIBRARY_PATH for the stubs library, if any.
+// Returns how many entries of 'envp' were set, or -1.
+static int
+setup_preload(char **envp, larmier_opts_t *larmier_opts)
+{
+    int err;
+
+    if (larmier_opts->stubslib == NULL) {
+        return 0;
+    }
+    assert(larmier_opts->stubsdir != NULL);
+
+    // The leak tracker goes last, as stubs may wrap malloc() et al.
+    if (larmier_opts->tracklib != NULL) {
+        err = asprintf(&envp[0], "LD_PRELOAD=%s:%s",
+                       larmier_opts->stubslib, larmier_opts->tracklib);
+    } else {
+        err = asprintf(&envp[0], "LD_PRELOAD=%s", larmier_opts->stubslib);
+    }
+    if (err == -1) {
+        perror("asprintf");
+        return -1;
+    }
+
+    err = asprintf(&envp[1], "LD_LIBRARY_PATH=%s", larmier_opts->stubsdir);
+    if (err == -1) {
+        perror("asprintf");
+        free(envp[0]);
+        return -1;
+    }
+
+    return 2;
+}
+
 static void
-exec_test(int pipefd, const char *bca_name, larmier_opts_t *larmier_opts)
+exec_test(int pipefd, int logfd, int ctlfd, int stfd, const char *bca_name,
+          larmier_opts_t *larmier_opts)
 {
-    char *envp[3];
+    char *envp[9];
     int i = 1;
     int err;
 
@@ -103,6 +370,28 @@ exec_test(int pipefd, const char *bca_name, larmier_opts_t *larmier_opts)
         return;
     }
 
+    // Keep valgrind's log apart from the test's output.
+    if (logfd != -1) {
+        err = setup_log(logfd);
+        if (err == -1) {
+            return;
+        }
+    }
+
+    // Place the control pipes where the stubs runtime expects them.
+    if (has_ctl(larmier_opts)) {
+        err = setup_ctl(ctlfd, stfd);
+        if (err == -1) {
+            return;
+        }
+    }
+
+    // Lead a process group, so all paths forked by the test (and anything
+    // else it, or valgrind, started) can be killed.
+    if (has_pgrp(larmier_opts)) {
+        (void)setpgid(0, 0);
+    }
+
     // Setup envp[0].
     err = asprintf(&envp[0], "%s=%s", LARMIER_BCA, bca_name);
     if (err == -1) {
@@ -110,23 +399,43 @@ exec_test(int pipefd, const char *bca_name, larmier_opts_t *larmier_opts)
         return;
     }
 
-    // Setup envp[1].
-    if (larmier_opts->stubslib != NULL) {
-        assert(larmier_opts->stubsdir != NULL);
+    // Setup envp[1] and envp[2].
+    err = setup_preload(&envp[i], larmier_opts);
+    if (err == -1) {
+        free(envp[0]);
+        return;
+    }
+    i += err;
+
+    // Ask the stubs runtime to park the test in a fork server.
+    if (larmier_opts->forksrv) {
+        envp[i++] = LARMIER_FORKSRV "=1";
+    }
+
+    // Ask the stubs runtime to fork at each call beyond the loaded prefix.
+    if (larmier_opts->explore) {
+        envp[i++] = LARMIER_EXPLORE "=1";
+    }
+
+    // Ask the stubs runtime not to fail call sites repeatedly.
+    if (larmier_opts->dedup) {
+        envp[i++] = LARMIER_DEDUP "=1";
+    }
 
-        err = asprintf(&envp[i++], "LD_PRELOAD=%s", larmier_opts->stubslib);
+    // Have sanitizers report errors with the same exit code as valgrind.
+    // The stubs library is preloaded ahead of the ASan runtime, which ASan
+    // would otherwise refuse.
+    if (larmier_opts->backend == BACKEND_SANITIZER) {
+        err = asprintf(&envp[i++], "ASAN_OPTIONS=verify_asan_link_order=0:"
+                       "detect_leaks=1:exitcode=%d", EXIT_ERR_VALGRIND);
         if (err == -1) {
             perror("asprintf");
-            free(envp[0]);
             return;
         }
-
-        err = asprintf(&envp[i++], "LD_LIBRARY_PATH=%s",
-                       larmier_opts->stubsdir);
+        err = asprintf(&envp[i++], "LSAN_OPTIONS=exitcode=%d",
+                       EXIT_ERR_VALGRIND);
         if (err == -1) {
             perror("asprintf");
-            free(envp[1]);
-            free(envp[0]);
             return;
         }
     }
@@ -135,104 +444,269 @@ exec_test(int pipefd, const char *bca_name, larmier_opts_t *larmier_opts)
     envp[i] = NULL;
 
     // Execute test.
-    execve(larmier_opts->valgrind_argv[0], larmier_opts->valgrind_argv, envp);
+    execve(larmier_opts->test_argv[0], larmier_opts->test_argv, envp);
     perror("execve");
 }
 
-static char *
-readall(int pipefd)
-{
-    char buf_tmp[256];
-    char *buf, *ptr;
-    size_t buf_size;
-    size_t bytes_read;
-    size_t bytes_left;
-
-    // Allocate initial buffer for reading the pipe's output.
-    buf_size = READBUF_SIZE;
-    buf = calloc(1, buf_size);
-    if (buf == NULL) {
-        perror("calloc");
-        goto err;
+static int
+spool_open(void)
+{
+    char name[] = "/tmp/larmier_XXXXXX";
+    int fd;
+
+    // Prefer an anonymous file, which never shows up in the directory.
+    fd = open("/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd != -1) {
+        return fd;
     }
 
-    // Read pipe into buf.
-    bytes_left = buf_size;
-    ptr = buf;
-    while ((bytes_read = read(pipefd, ptr, bytes_left)) > 0) {
-        // Adjust values for next iteration.
-        bytes_left -= bytes_read;
-        ptr += bytes_read;
+    fd = mkostemp(name, O_CLOEXEC);
+    if (fd == -1) {
+        perror("mkostemp");
+        return -1;
+    }
+    (void)unlink(name);
 
-        // Increase buffer size if output too long.
-        if (bytes_left == 0) {
-            char *new_buf;
+    return fd;
+}
 
-            buf_size += READBUF_SIZE;
-            new_buf = realloc(buf, buf_size);
-            if (new_buf == NULL) {
-                goto err;
-            }
-            buf = new_buf;
+static inline uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Forget about the previous path's output and log.
+static void
+worker_reset(larmier_worker_t *worker)
+{
+    if (worker->spool == -1) {
+        worker->spool = spool_open();
+    } else if (ftruncate(worker->spool, 0) == -1 ||
+               lseek(worker->spool, 0, SEEK_SET) == -1) {
+        perror("ftruncate");
+        (void)close(worker->spool);
+        worker->spool = -1;
+    }
 
-            (void)memset(ptr, 0, READBUF_SIZE);
-            bytes_left = READBUF_SIZE;
+    worker->line_len = 0;
+    worker->fd_leaks = 0;
+    worker->mc_error = false;
+    worker->mc_abort = false;
+    worker->timed_out = false;
+    (void)memset(&worker->rusage, 0, sizeof(worker->rusage));
+    worker->start = now_ns();
+    worker->ready = worker->start;
+    worker->output = 0;
+    worker->exit = 0;
+    worker->drain = 0;
+}
+
+// Memcheck errors which the path can't recover from. Leaks are left out, as
+// they are only reported on exit anyway.
+static const char *mc_errors[] = {
+    "Invalid read of size ",
+    "Invalid write of size ",
+    "Invalid free() / delete / delete[] / realloc()",
+    "Mismatched free() / delete / delete []",
+    "Conditional jump or move depends on uninitialised value(s)",
+    "Use of uninitialised value of size ",
+    "Syscall param ",
+    "Source and destination overlap in ",
+    NULL,
+};
+
+static void
+worker_log_error(larmier_worker_t *worker)
+{
+    const char *str;
+    int i;
+
+    // Skip the "==<pid>== " prefix.
+    if (strncmp(worker->line, "==", 2) != 0) {
+        return;
+    }
+    str = strstr(worker->line + 2, "== ");
+    if (str == NULL) {
+        return;
+    }
+    str += strlen("== ");
+
+    // The error ends with a blank line, after its backtrace.
+    if (worker->mc_error) {
+        if (*str == '\0') {
+            worker->mc_abort = true;
+        }
+        return;
+    }
+
+    for (i = 0; mc_errors[i] != NULL; i++) {
+        if (strncmp(str, mc_errors[i], strlen(mc_errors[i])) == 0) {
+            worker->mc_error = true;
+            return;
         }
     }
+}
+
+static void
+worker_log_line(larmier_worker_t *worker)
+{
+    const char *str;
+    long fd;
 
-    return buf;
+    worker_log_error(worker);
 
-err:
-    // Drain pipe and return error or shortcounted buf.
-    while (read(pipefd, buf_tmp, sizeof(buf_tmp)) > 0);
-    return buf;
+    str = strstr(worker->line, " Open file descriptor ");
+    if (str == NULL) {
+        return;
+    }
+
+    // "LastTest.log.tmp" is a ctest bug, the rest are our own pipes.
+    fd = strtol(str + strlen(" Open file descriptor "), NULL, 10);
+    if (strstr(str, "Testing/Temporary/LastTest.log.tmp") == NULL &&
+        fd != LARMIER_CTL_FD && fd != LARMIER_ST_FD && fd != VALGRIND_LOG_FD) {
+        worker->fd_leaks++;
+    }
 }
 
-static int
-has_fd_leaks(char *valgrind_buf)
+static ssize_t
+worker_read(larmier_worker_t *worker, int fd)
 {
-    char *line, *eol;
+    char buf[READBUF_SIZE];
+    ssize_t bytes_read;
+    ssize_t i;
 
-    if (valgrind_buf == NULL) {
+    // Report a drained pipe as -1 and EOF (or a broken pipe) as zero.
+    bytes_read = read(fd, buf, sizeof(buf));
+    if (bytes_read == -1 && errno != EINTR && errno != EAGAIN) {
         return 0;
     }
+    if (bytes_read <= 0) {
+        return bytes_read;
+    }
 
-    line = strstr(valgrind_buf, " Open file descriptor ");
-    if (line != NULL) {
-        // Check if this leak is "LastTest.log.tmp".
-        eol = strchr(line, '\n');
-        *eol = '\0';
-        if (strstr(line, "Testing/Temporary/LastTest.log.tmp") == NULL) {
-            // Definitely a leak.
-            *eol = '\n';
-            return 1;
+    // Keep everything in the spool, in case the path fails.
+    if (worker->spool != -1 &&
+        write(worker->spool, buf, bytes_read) != bytes_read) {
+        perror("write");
+        (void)close(worker->spool);
+        worker->spool = -1;
+    }
+
+    // Look for fd leaks in the valgrind log as it comes.
+    if (fd != worker->logfd) {
+        if (worker->output == 0) {
+            worker->output = now_ns();
+        }
+        return bytes_read;
+    }
+    for (i = 0; i < bytes_read; i++) {
+        if (buf[i] == '\n') {
+            worker->line[worker->line_len] = '\0';
+            worker_log_line(worker);
+            worker->line_len = 0;
+        } else if (worker->line_len < sizeof(worker->line) - 1) {
+            worker->line[worker->line_len++] = buf[i];
         }
+    }
+
+    return bytes_read;
+}
+
+static void
+worker_drain_fd(larmier_worker_t *worker, int *fd)
+{
+    ssize_t bytes_read;
 
-        // The leak was a ctest bug, ignore and check rest of buffer.
-        *eol = '\n';
-        return has_fd_leaks(eol+1);
+    if (*fd == -1) {
+        return;
     }
 
-    return 0;
+    do {
+        bytes_read = worker_read(worker, *fd);
+    } while (bytes_read > 0 || (bytes_read == -1 && errno == EINTR));
+
+    if (bytes_read == 0) {
+        (void)close(*fd);
+        *fd = -1;
+    }
 }
 
-static inline void
-vgbuf_dump(larmier_opts_t *larmier_opts, char *valgrind_buf)
+static void
+worker_drain(larmier_worker_t *worker)
+{
+    uint64_t start = now_ns();
+
+    worker_drain_fd(worker, &worker->pipefd);
+    worker_drain_fd(worker, &worker->logfd);
+    worker->drain += now_ns() - start;
+}
+
+static void
+output_dump(int spool)
 {
-    if (larmier_opts->debug < 2) {
+    char buf[READBUF_SIZE];
+    ssize_t len;
+    off_t off = 0;
+
+    if (spool == -1) {
         return;
     }
 
     POUT("********************************\n");
-    POUT("Valgrind buf:\n");
-    POUT("%s", valgrind_buf);
+    POUT("Output:\n");
+    while ((len = pread(spool, buf, sizeof(buf), off)) > 0) {
+        (void)fwrite(buf, 1, len, stdout);
+        off += len;
+    }
     POUT("********************************\n");
 }
 
+// The real call is '1' and a stub's first outcome '0', as when stubs only
+// had one. Alternative outcomes follow as 'a', 'b', ... With streams, calls
+// which weren't made are '-'.
+static inline char
+outcome_char(unsigned int val)
+{
+    val = BCA_OUTCOME(val);
+    if (val == BCA_REAL) {
+        return '1';
+    }
+    if (val == BCA_UNUSED) {
+        return '-';
+    }
+
+    return (val == 0) ? '0' : 'a' + val - 1;
+}
+
+// The reverse of outcome_char(), or -1 if 'c' is no outcome.
+static inline int
+outcome_val(char c)
+{
+    if (c == '1') {
+        return BCA_REAL;
+    }
+    if (c == '0') {
+        return 0;
+    }
+    if (c == '-') {
+        return BCA_UNUSED;
+    }
+    if (c >= 'a' && c < 'a' + BCA_OUTCOMES - 1) {
+        return c - 'a' + 1;
+    }
+
+    return -1;
+}
+
 static inline void
 bca_dump(larmier_opts_t *larmier_opts, bca_ctx_t *bca_ctx)
 {
-    int i;
+    uint32_t i;
 
     assert(larmier_opts != NULL);
     assert(bca_ctx != NULL);
@@ -243,546 +717,3690 @@ bca_dump(larmier_opts_t *larmier_opts, bca_ctx_t *bca_ctx)
 
     POUT("********************************\n");
     POUT("Name: '%s'\n", bca_ctx->bca_name);
-    POUT("Count: %hu\n", bca_ctx->bca->count);
+    POUT("Count: %u\n", bca_ctx->bca->count);
+    if (bca_ctx->bca->heap_leaks > 0 || bca_ctx->bca->fd_leaks > 0) {
+        POUT("Leaks: %u allocations, %u file descriptors\n",
+             bca_ctx->bca->heap_leaks, bca_ctx->bca->fd_leaks);
+    }
 
     for (i = 0; i < bca_ctx->bca->count; i++) {
-        POUT("%c", bca_ctx->bca->map[i] + '0');
+        POUT("%c", outcome_char(bca_get(bca_ctx->bca->map, i)));
     }
     POUT("\n");
 
     POUT("********************************\n");
 }
 
-static int
-larmier_loop(bca_ctx_t *bca_ctx, larmier_opts_t *larmier_opts)
+static larmier_snap_t *
+snap_new(const uint8_t *map, uint32_t len)
 {
-    int pipefd[2];
-    int status;
-    int i;
-    int err;
-    pid_t pid;
-    char *valgrind_buf;
+    larmier_snap_t *snap;
 
-    assert(bca_ctx != NULL);
-    assert(larmier_opts != NULL);
-    assert(larmier_opts->valgrind_argv != NULL);
-
-    // Create a pipe to communicate with valgrind et al.
-    err = pipe(pipefd);
-    if (err == -1) {
-        perror("pipe");
-        goto err;
+    snap = malloc(sizeof(*snap) + BCA_BYTES(len));
+    if (snap == NULL) {
+        perror("malloc");
+        return NULL;
     }
 
-    // Spawn and execute valgrind with test program.
-    pid = fork();
-    switch (pid) {
-    case -1:
-        perror("fork");
-        goto err;
-    case 0:
-        // Child doesn't need pipefd[0].
-        (void)close(pipefd[0]);
+    snap->refs = 1;
+    snap->len = len;
+    (void)memcpy(snap->map, map, BCA_BYTES(len));
 
-        // Execute the test under valgrind.
-        exec_test(pipefd[1], bca_ctx->bca_name, larmier_opts);
-        exit(EXIT_ERR_LARMIER);
-    }
+    return snap;
+}
 
-    // Parent doesn't write into pipefd[1].
-    (void)close(pipefd[1]);
+static void
+snap_put(larmier_snap_t *snap)
+{
+    if (snap != NULL && --snap->refs == 0) {
+        free(snap);
+    }
+}
 
-    // Read from child's stdout/stderr into a buffer.
-    valgrind_buf = readall(pipefd[0]);
+static larmier_path_t *
+path_new(larmier_snap_t *snap, uint32_t len, unsigned int last)
+{
+    larmier_path_t *path;
 
-    // Parent doesn't need pipefd[0] anymore either.
-    (void)close(pipefd[0]);
+    assert(len == 0 || (snap != NULL && len <= snap->len));
 
-    // Wait for valgrind to exit.
-    (void)waitpid(pid, &status, 0);
+    path = malloc(sizeof(*path));
+    if (path == NULL) {
+        perror("malloc");
+        return NULL;
+    }
 
-    // Potentially exit early if valgrind encountered errors.
-    err = EXIT_MASK_SYSTEM;
-    if (WEXITSTATUS(status) == EXIT_ERR_LARMIER) {
-        // Larmier failed.
-        err |= EXIT_ERR_LARMIER;
-        goto err_early;
+    path->snap = snap;
+    path->len = len;
+    path->last = last;
+    path->seed = false;
+    if (snap != NULL) {
+        snap->refs++;
     }
-    if (!WIFEXITED(status)) {
-        // Test terminated abnormally.
-        err |= EXIT_ERR_ABNORMAL;
-        goto err_early;
+
+    return path;
+}
+
+static void
+path_free(larmier_path_t *path)
+{
+    if (path != NULL) {
+        snap_put(path->snap);
+        free(path);
     }
-    if (WEXITSTATUS(status) == EXIT_ERR_VALGRIND) {
-        // Valgrind found leaks.
-        err |= EXIT_ERR_VALGRIND;
-        goto err_early;
+}
+
+// Returns the outcome of call 'i', including whether it was the last one.
+static inline unsigned int
+path_get(const larmier_path_t *path, uint32_t i)
+{
+    // Calls beyond a path's length are failed (ie. zero).
+    if (i >= path->len) {
+        return 0;
     }
-    if (has_fd_leaks(valgrind_buf)) {
-        // Valgrind reported fd leaks.
-        err |= EXIT_ERR_FDLEAKS;
-        goto err_early;
+    if (i == path->len - 1) {
+        return path->last;
     }
 
-    // Maybe dump valgrind buffer.
-    vgbuf_dump(larmier_opts, valgrind_buf);
-
-    // Maybe dump bca.
-    bca_dump(larmier_opts, bca_ctx);
-
-    // Free buffer.
-    free(valgrind_buf);
+    return bca_get(path->snap->map, i);
+}
 
-    // Flip last non-zero call.
-    for (i = bca_ctx->bca->count - 1; i >= 0; i--) {
-        if (bca_ctx->bca->map[i] == 0) {
-            bca_ctx->bca->map[i] = 1;
-            (void)memset(&bca_ctx->bca->map[i + 1], 0, BCA_MAP_LEN - i - 1);
-            break;
+static int
+path_cmp(const larmier_path_t *a, const larmier_path_t *b)
+{
+    uint32_t len = (a->len > b->len) ? a->len : b->len;
+    uint32_t min = (a->len < b->len) ? a->len : b->len;
+    uint32_t i = 0;
+    unsigned int ca, cb;
+
+    // Skip over the common prefix a byte at a time, or all at once for
+    // paths queued off the same run.
+    if (min > 0 && a->snap == b->snap) {
+        i = min - 1;
+    } else {
+        while (i + 8 / BCA_BITS < min &&
+               a->snap->map[i * BCA_BITS / 8] ==
+               b->snap->map[i * BCA_BITS / 8]) {
+            i += 8 / BCA_BITS;
         }
     }
 
-    if (i < 0) {
-        // Nothing else to flip, use actual exit status.
-        return (EXIT_MASK_TEST | WEXITSTATUS(status));
+    for (; i < len; i++) {
+        ca = BCA_OUTCOME(path_get(a, i));
+        cb = BCA_OUTCOME(path_get(b, i));
+        if (ca != cb) {
+            return (ca < cb) ? -1 : 1;
+        }
     }
 
-    // Reset counter.
-    bca_ctx->bca->count = 0;
-
     return 0;
+}
 
-err:
-    return (EXIT_MASK_SYSTEM | EXIT_ERR_LARMIER);
-
-err_early:
-    vgbuf_dump(larmier_opts, valgrind_buf);
-    bca_dump(larmier_opts, bca_ctx);
-    free(valgrind_buf);
+static void
+path_write(FILE *stream, larmier_path_t *path)
+{
+    uint32_t i;
 
-    return err;
+    for (i = 0; i < path->len; i++) {
+        (void)fputc(outcome_char(path_get(path, i)), stream);
+    }
 }
 
-static inline void
-bca_ctx_destroy(bca_ctx_t *bca_ctx)
+static void
+path_dump(larmier_path_t *path)
 {
-    (void)munmap(bca_ctx->bca, LARMIER_LEN);
-    (void)shm_unlink(bca_ctx->bca_name);
-    free(bca_ctx->bca_name);
-    free(bca_ctx);
+    POUT("Failed path: ");
+    path_write(stdout, path);
+    POUT("\n");
 }
 
-static inline void *
-bca_ctx_create(void)
+// Parses a path as written by path_write().
+static larmier_path_t *
+path_read(const char *str)
 {
-    bca_ctx_t *bca_ctx;
-    int bca_fd;
-    int err;
+    larmier_snap_t *snap;
+    larmier_path_t *path;
+    size_t len = strlen(str);
+    size_t i;
+    int val;
+
+    if (len == 0) {
+        return path_new(NULL, 0, 0);
+    }
+    if (len > UINT32_MAX) {
+        PERR("Path too long\n");
+        return NULL;
+    }
 
-    // Allocate context for branch control array.
-    bca_ctx = calloc(1, sizeof(*bca_ctx));
-    if (bca_ctx == NULL) {
+    snap = calloc(1, sizeof(*snap) + BCA_BYTES(len));
+    if (snap == NULL) {
         perror("calloc");
         return NULL;
     }
-
-    // Define unique name for bca shm entry.
-    err = asprintf(&bca_ctx->bca_name, "larmier_%u", getpid());
-    if (err == -1) {
-        perror("asprintf");
-        goto err;
+    snap->refs = 1;
+    snap->len = len;
+
+    for (i = 0; i < len; i++) {
+        val = outcome_val(str[i]);
+        if (val == -1) {
+            PERR("Invalid path '%s'\n", str);
+            snap_put(snap);
+            return NULL;
+        }
+        bca_set(snap->map, i, val);
     }
 
-    // Open an shm entry for bca.
-    bca_fd = shm_open(bca_ctx->bca_name, O_CREAT | O_RDWR, 0666);
-    if (bca_fd == -1) {
-        perror("shm_open");
-        goto err_free;
+    path = path_new(snap, len, bca_get(snap->map, len - 1));
+    snap_put(snap);
+
+    return path;
+}
+
+// Returns a path making its first 'len' calls for real.
+static larmier_path_t *
+path_real(uint32_t len)
+{
+    larmier_snap_t *snap;
+    larmier_path_t *path;
+
+    if (len == 0) {
+        return path_new(NULL, 0, 0);
     }
 
-    // Set initial bca size.
-    (void)ftruncate(bca_fd, LARMIER_LEN);
+    snap = malloc(sizeof(*snap) + BCA_BYTES(len));
+    if (snap == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    snap->refs = 1;
+    snap->len = len;
+    (void)memset(snap->map, 0xFF, BCA_BYTES(len));     // BCA_REAL is all ones
 
-    // Map and zero out bca area from fd.
-    bca_ctx->bca = mmap(NULL, LARMIER_LEN, PROT_READ | PROT_WRITE,
-                        MAP_SHARED, bca_fd, 0);
-    if (bca_ctx->bca == MAP_FAILED) {
-        perror("mmap");
-        goto err_close;
+    path = path_new(snap, len, BCA_REAL);
+    snap_put(snap);
+
+    return path;
+}
+
+static int
+deque_push(path_deque_t *deque, larmier_path_t *path)
+{
+    // Reclaim stolen slots before growing.
+    if (deque->tail == deque->size && deque->head > 0) {
+        (void)memmove(deque->paths, &deque->paths[deque->head],
+                      (deque->tail - deque->head) * sizeof(*deque->paths));
+        deque->tail -= deque->head;
+        deque->head = 0;
     }
-    (void)memset(bca_ctx->bca, 0, LARMIER_LEN);
 
-    // Done.
-    (void)close(bca_fd);
-    return bca_ctx;
+    if (deque->tail == deque->size) {
+        larmier_path_t **new_paths;
+        size_t new_size = deque->size ? deque->size * 2 : 64;
 
-err_close:
-    (void)close(bca_fd);
-    (void)shm_unlink(bca_ctx->bca_name);
+        new_paths = realloc(deque->paths, new_size * sizeof(*new_paths));
+        if (new_paths == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        deque->paths = new_paths;
+        deque->size = new_size;
+    }
 
-err_free:
-    free(bca_ctx->bca_name);
+    deque->paths[deque->tail++] = path;
 
-err:
-    free(bca_ctx);
-    return NULL;
+    return 0;
+}
+
+static inline size_t
+deque_len(path_deque_t *deque)
+{
+    return deque->tail - deque->head;
+}
+
+static inline larmier_path_t *
+deque_pop(path_deque_t *deque)
+{
+    if (deque_len(deque) == 0) {
+        return NULL;
+    }
+
+    return deque->paths[--deque->tail];
+}
+
+static inline larmier_path_t *
+deque_steal(path_deque_t *deque)
+{
+    if (deque_len(deque) == 0) {
+        return NULL;
+    }
+
+    return deque->paths[deque->head++];
+}
+
+static void
+deque_prune(path_deque_t *deque, larmier_path_t *fail)
+{
+    size_t i, j;
+
+    // Drop every path which comes after 'fail' in DFS order. The subtree of
+    // a prefix never precedes the prefix itself, so they cannot matter.
+    for (i = j = deque->head; i < deque->tail; i++) {
+        if (path_cmp(deque->paths[i], fail) > 0) {
+            path_free(deque->paths[i]);
+        } else {
+            deque->paths[j++] = deque->paths[i];
+        }
+    }
+    deque->tail = j;
+}
+
+static void
+deque_destroy(path_deque_t *deque)
+{
+    larmier_path_t *path;
+
+    while ((path = deque_pop(deque)) != NULL) {
+        path_free(path);
+    }
+    free(deque->paths);
 }
 
 static int
-larmier(larmier_opts_t *larmier_opts)
+larmier_status(int status, larmier_worker_t *worker,
+               larmier_opts_t *larmier_opts)
 {
-    bca_ctx_t *bca_ctx;
+    bca_t *bca = worker->bca_ctx->bca;
+    int err = EXIT_MASK_SYSTEM;
+
+    if (worker->timed_out) {
+        // The path was killed for taking too long.
+        return (err | EXIT_ERR_TIMEOUT);
+    }
+    if (worker->mc_abort) {
+        // The path was killed on a memcheck error.
+        return (err | EXIT_ERR_VALGRIND);
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_ERR_LARMIER) {
+        // Larmier failed.
+        return (err | EXIT_ERR_LARMIER);
+    }
+    if (!WIFEXITED(status)) {
+        // Test terminated abnormally.
+        return (err | EXIT_ERR_ABNORMAL);
+    }
+    if (larmier_opts->backend == BACKEND_NONE) {
+        // Nothing else to check.
+        return 0;
+    }
+    if (bca->heap_leaks > 0) {
+        // The leak tracker found leaks.
+        return (err | EXIT_ERR_VALGRIND);
+    }
+    if (bca->fd_leaks > 0) {
+        // The leak tracker found fd leaks.
+        return (err | EXIT_ERR_FDLEAKS);
+    }
+    if (WEXITSTATUS(status) == EXIT_ERR_VALGRIND) {
+        // Valgrind (or a sanitizer) found errors or leaks.
+        return (err | EXIT_ERR_VALGRIND);
+    }
+    if (worker->fd_leaks > 0) {
+        // Valgrind reported fd leaks.
+        return (err | EXIT_ERR_FDLEAKS);
+    }
+
+    return 0;
+}
+
+static int
+worker_start(larmier_worker_t *worker, larmier_opts_t *larmier_opts)
+{
+    int pipefd[2];
+    int logfd[2] = { -1, -1 };
+    int ctlfd[2] = { -1, -1 };
+    int stfd[2] = { -1, -1 };
     int err;
+    pid_t pid;
 
-    assert(larmier_opts != NULL);
-    assert(larmier_opts->valgrind_argv != NULL);
+    assert(worker->pid == 0);
 
-    // Create branch control array context.
-    bca_ctx = bca_ctx_create();
-    if (bca_ctx == NULL) {
+    // Create a pipe to communicate with valgrind et al. Other workers must
+    // not inherit it, or valgrind would report it as a leaked descriptor.
+    err = pipe2(pipefd, O_CLOEXEC);
+    if (err == -1) {
+        perror("pipe");
         return -1;
     }
 
-    // Loop exploring branches.
-    do {
-        err = larmier_loop(bca_ctx, larmier_opts);
-    } while ((err & EXIT_MASK) == 0);
+    // Create a pipe for valgrind's log, which is parsed as it comes.
+    if (larmier_opts->backend == BACKEND_VALGRIND &&
+        pipe2(logfd, O_CLOEXEC) == -1) {
+        perror("pipe");
+        goto err;
+    }
 
-    // Clean up.
-    bca_ctx_destroy(bca_ctx);
+    // Create pipes to command the test and collect path statuses.
+    if (has_ctl(larmier_opts)) {
+        if (pipe2(ctlfd, O_CLOEXEC) == -1 || pipe2(stfd, O_CLOEXEC) == -1) {
+            perror("pipe");
+            goto err;
+        }
+    }
 
-    if (larmier_opts->debug > 0) {
-        POUT("Larmier exit status: 0x%X\n", err);
+    // Spawn and execute valgrind with test program.
+    pid = fork();
+    switch (pid) {
+    case -1:
+        perror("fork");
+        goto err;
+    case 0:
+        // Execute the test under valgrind.
+        exec_test(pipefd[1], logfd[1], ctlfd[0], stfd[1],
+                  worker->bca_ctx->bca_name, larmier_opts);
+        _exit(EXIT_ERR_LARMIER);
     }
 
-    return (err & ~EXIT_MASK);
+    // Also from here, so the group can be killed before the child ran.
+    if (has_pgrp(larmier_opts)) {
+        (void)setpgid(pid, pid);
+    }
+
+    // Parent doesn't write into pipefd[1] (or read from the control pipes).
+    (void)close(pipefd[1]);
+    if (logfd[1] != -1) {
+        (void)close(logfd[1]);
+        (void)fcntl(logfd[0], F_SETFL, O_NONBLOCK);
+    }
+    if (has_ctl(larmier_opts)) {
+        (void)close(ctlfd[0]);
+        (void)close(stfd[1]);
+    }
+
+    // Output is drained without blocking once a fork server reports a path.
+    (void)fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+
+    worker->pid = pid;
+    worker->pipefd = pipefd[0];
+    worker->logfd = logfd[0];
+    worker->ctlfd = ctlfd[1];
+    worker->stfd = stfd[0];
+
+    return 0;
+
+err:
+    (void)close(pipefd[0]);
+    (void)close(pipefd[1]);
+    if (logfd[0] != -1) {
+        (void)close(logfd[0]);
+        (void)close(logfd[1]);
+    }
+    if (ctlfd[0] != -1) {
+        (void)close(ctlfd[0]);
+        (void)close(ctlfd[1]);
+    }
+    if (stfd[0] != -1) {
+        (void)close(stfd[0]);
+        (void)close(stfd[1]);
+    }
+    return -1;
 }
 
-static char *
-which(const char *name)
+static inline void
+worker_kill(larmier_worker_t *worker, larmier_opts_t *larmier_opts)
 {
-    char *spath, *spath_iter;
-    char *exe = NULL;
+    assert(worker->pid != 0);
 
-    assert(name != NULL);
+    // The test leads a process group including any paths it forked.
+    if (has_pgrp(larmier_opts)) {
+        (void)kill(-worker->pid, SIGKILL);
+    } else {
+        (void)kill(worker->pid, SIGKILL);
+    }
+}
 
-    // Fetch PATH from environ.
-    spath = getenv("PATH");
-    if (spath == NULL) {
-        goto out;
+static int
+worker_reap(larmier_worker_t *worker)
+{
+    int status = 0;
+
+    assert(worker->pid != 0);
+
+    // Wait for valgrind to exit and collect anything it wrote last.
+    (void)wait4(worker->pid, &status, 0, &worker->rusage);
+    worker_drain(worker);
+
+    // Parent doesn't need the pipes anymore.
+    if (worker->pipefd != -1) {
+        (void)close(worker->pipefd);
+    }
+    if (worker->logfd != -1) {
+        (void)close(worker->logfd);
     }
+    if (worker->ctlfd != -1) {
+        (void)close(worker->ctlfd);
+        (void)close(worker->stfd);
+    }
+    worker->pid = 0;
+    worker->pipefd = -1;
+    worker->logfd = -1;
+    worker->ctlfd = -1;
+    worker->stfd = -1;
 
-    // Copy environ to our heap for mangling.
-    spath_iter = spath = strdup(spath);
-    if (spath_iter == NULL) {
-        goto out;
+    return status;
+}
+
+// Catch up with a bca grown by the test (see larmier_stub.h).
+static int
+bca_sync(bca_ctx_t *bca_ctx)
+{
+    size_t size = bca_ctx->bca->size;
+    bca_t *bca;
+
+    if (size <= bca_ctx->bca_len) {
+        return 0;
     }
-    // nb. the above keeps the copy in 'spath' for free()ing.
 
-    // Iterate over PATH searching for the executable.
-    while ((spath_iter = strtok(spath_iter, ":")) != NULL) {
-        // Allocate an 'exe' string with a full path to the executable.
-        if (asprintf(&exe, "%s/%s", spath_iter, name) == -1) {
-            perror("asprintf");
-            exe = NULL;
-            goto out;
+    bca = mremap(bca_ctx->bca, bca_ctx->bca_len, size, MREMAP_MAYMOVE);
+    if (bca == MAP_FAILED) {
+        perror("mremap");
+        return -1;
+    }
+    bca_ctx->bca = bca;
+    bca_ctx->bca_len = size;
+
+    return 0;
+}
+
+// Grow the bca so it holds at least 'len' calls.
+static int
+bca_reserve(bca_ctx_t *bca_ctx, uint32_t len)
+{
+    size_t size = bca_ctx->bca_len;
+    bca_t *bca;
+    int bca_fd;
+
+    if (len <= BCA_CAPACITY(size)) {
+        return 0;
+    }
+    while (len > BCA_CAPACITY(size)) {
+        size *= 2;
+    }
+    if (size > UINT32_MAX) {
+        PERR("Branch control array too large\n");
+        return -1;
+    }
+
+    bca_fd = shm_open(bca_ctx->bca_name, O_RDWR, 0600);
+    if (bca_fd == -1) {
+        perror("shm_open");
+        return -1;
+    }
+    if (ftruncate(bca_fd, size) == -1) {
+        perror("ftruncate");
+        (void)close(bca_fd);
+        return -1;
+    }
+    (void)close(bca_fd);
+
+    bca = mremap(bca_ctx->bca, bca_ctx->bca_len, size, MREMAP_MAYMOVE);
+    if (bca == MAP_FAILED) {
+        perror("mremap");
+        return -1;
+    }
+    bca->size = size;
+    bca_ctx->bca = bca;
+    bca_ctx->bca_len = size;
+
+    return 0;
+}
+
+// With streams, mark the calls which their stream didn't get to.
+static void
+bca_unused(bca_t *bca)
+{
+    uint32_t i;
+
+    if (bca->streams <= 1) {
+        return;
+    }
+    for (i = 0; i < bca->count; i++) {
+        if (i / bca->streams >= bca->calls[i % bca->streams]) {
+            bca_set(bca->map, i, BCA_UNUSED);
         }
+    }
+    if (bca->dirty < bca->count) {
+        bca->dirty = bca->count;
+    }
+}
 
-        // Check if there's an executable valgrind at 'exe'.
-        if (access(exe, X_OK) == 0) {
-            // Found.
-            goto out;
+static int
+bca_load(bca_ctx_t *bca_ctx, larmier_path_t *path)
+{
+    bca_t *bca;
+    uint32_t end;
+    uint32_t i;
+
+    if (bca_sync(bca_ctx) == -1 || bca_reserve(bca_ctx, path->len) == -1) {
+        return -1;
+    }
+    bca = bca_ctx->bca;
+
+    bca->count = 0;
+    bca->prefix = path->len;
+
+    // Copy the prefix, zeroing calls beyond it which share its last byte.
+    if (path->len > 0) {
+        (void)memcpy(bca->map, path->snap->map, BCA_BYTES(path->len));
+        bca_set(bca->map, path->len - 1, path->last);
+    }
+    end = BCA_BYTES(path->len) * 8 / BCA_BITS;
+    for (i = path->len; i < end; i++) {
+        bca_set(bca->map, i, 0);
+    }
+
+    // Only clear what the last run (or path) may have set.
+    if (bca->dirty > end) {
+        (void)memset(&bca->map[BCA_BYTES(end)], 0,
+                     BCA_BYTES(bca->dirty) - BCA_BYTES(end));
+    }
+    bca->dirty = path->len;
+    bca->heap_leaks = 0;
+    bca->fd_leaks = 0;
+    bca->pruned = 0;
+    bca->traces = 0;
+    (void)memset(bca->ring, 0, sizeof(bca->ring));
+    (void)memset(bca->calls, 0, sizeof(bca->calls));
+
+    return 0;
+}
+
+static int
+worker_spawn(larmier_worker_t *worker, larmier_opts_t *larmier_opts)
+{
+    char cmd = 0;
+    int err;
+
+    assert(worker->path != NULL);
+
+    // Load the path into the worker's bca.
+    err = bca_load(worker->bca_ctx, worker->path);
+    if (err == -1) {
+        return -1;
+    }
+
+    worker_reset(worker);
+
+    // Start valgrind, unless a fork server is already parked.
+    if (worker->pid == 0) {
+        err = worker_start(worker, larmier_opts);
+        if (err == -1) {
+            return -1;
         }
+    }
+    if (!larmier_opts->forksrv) {
+        worker->ready = now_ns();
+        return 0;
+    }
 
-        // Not found. Adjust variables for next iteration.
-        free(exe);
-        spath_iter = NULL;
+    // Ask the fork server to run the path, restarting it if it went away.
+    if (write(worker->ctlfd, &cmd, sizeof(cmd)) != sizeof(cmd)) {
+        worker_kill(worker, larmier_opts);
+        (void)worker_reap(worker);
+        worker_reset(worker);
+
+        err = worker_start(worker, larmier_opts);
+        if (err == -1) {
+            return -1;
+        }
+        if (write(worker->ctlfd, &cmd, sizeof(cmd)) != sizeof(cmd)) {
+            perror("write");
+            return -1;
+        }
+    }
+    worker->ready = now_ns();
+
+    return 0;
+}
+
+static void
+worker_finish(larmier_ctx_t *larmier_ctx, larmier_worker_t *worker)
+{
+    path_free(worker->path);
+    worker->path = NULL;
+    larmier_ctx->busy--;
+    if (larmier_ctx->slots != NULL) {
+        (*larmier_ctx->slots)++;
+    }
+}
+
+// Copy the backtraces of the injections on the path left in 'bca', ordered
+// by call. When exploring, the ring may also hold those of paths forked off
+// earlier, which either took a real call at the same point or were since
+// overwritten by a later injection.
+static unsigned int
+traces_get(const bca_t *bca, bca_trace_t *traces)
+{
+    const bca_trace_t *trace;
+    unsigned int ntraces = 0;
+    unsigned int i, j;
+
+    for (i = 0; i < BCA_RING; i++) {
+        trace = &bca->ring[i];
+        if (trace->seq == 0 || trace->slot >= bca->count ||
+            !bca_failed(bca_get(bca->map, trace->slot))) {
+            continue;
+        }
+
+        // Keep the latest one of each call, in order.
+        for (j = 0; j < ntraces && traces[j].slot < trace->slot; j++) {
+            continue;
+        }
+        if (j < ntraces && traces[j].slot == trace->slot) {
+            if (traces[j].seq < trace->seq) {
+                traces[j] = *trace;
+            }
+            continue;
+        }
+        (void)memmove(&traces[j + 1], &traces[j],
+                      (ntraces - j) * sizeof(*traces));
+        traces[j] = *trace;
+        ntraces++;
+    }
+
+    return ntraces;
+}
+
+static void
+larmier_fail(larmier_ctx_t *larmier_ctx, larmier_path_t *path, int err,
+             int spool, const bca_t *bca, larmier_opts_t *larmier_opts)
+{
+    larmier_worker_t *worker;
+    int i;
+
+    // Only the first failure in DFS order is reported, as sequentially.
+    if (larmier_ctx->fail != NULL && path_cmp(path, larmier_ctx->fail) > 0) {
+        path_free(path);
+        if (spool != -1) {
+            (void)close(spool);
+        }
+        return;
+    }
+    path_free(larmier_ctx->fail);
+    larmier_ctx->fail = path;
+    larmier_ctx->fail_err = err;
+    larmier_ctx->fail_ntraces = traces_get(bca, larmier_ctx->fail_traces);
+
+    // Keep the failing path's output around, to be reported at the end.
+    if (larmier_ctx->fail_spool != -1) {
+        (void)close(larmier_ctx->fail_spool);
+    }
+    larmier_ctx->fail_spool = spool;
+
+    // Discard anything which would only have been explored afterwards.
+    for (i = 0; i < larmier_ctx->nworkers; i++) {
+        worker = &larmier_ctx->workers[i];
+        deque_prune(&worker->deque, path);
+        if (worker->path != NULL && path_cmp(worker->path, path) > 0) {
+            worker_kill(worker, larmier_opts);
+            (void)worker_reap(worker);
+            worker_finish(larmier_ctx, worker);
+        }
+    }
+}
+
+static const char *
+exit_class(int err)
+{
+    if ((err & EXIT_MASK_SYSTEM) == 0) {
+        return "OK";
+    }
+
+    switch (err & ~EXIT_MASK) {
+    case EXIT_ERR_TIMEOUT:
+        return "TIMEOUT";
+    case EXIT_ERR_ABNORMAL:
+        return "ABNORMAL";
+    case EXIT_ERR_FDLEAKS:
+        return "FDLEAKS";
+    case EXIT_ERR_LARMIER:
+        return "LARMIER";
+    case EXIT_ERR_VALGRIND:
+        return "VALGRIND";
+    }
+
+    return "UNKNOWN";
+}
+
+static inline int64_t
+timeval_us(const struct timeval *tv)
+{
+    return (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+// Write a JSON record of a path: its outcomes, which calls were injected, how
+// it was classified and what it cost.
+static void
+report_path(FILE *stream, const larmier_result_t *result)
+{
+    const char *sep = "";
+    uint32_t i;
+
+    fprintf(stream, "{\"path\":\"%s\",\"injected\":[", result->path);
+    for (i = 0; result->path[i] != '\0'; i++) {
+        if (result->path[i] != '1' && result->path[i] != '-') {
+            fprintf(stream, "%s%u", sep, i);
+            sep = ",";
+        }
+    }
+    fprintf(stream, "],\"class\":\"%s\",\"status\":%d,", result->exit_class,
+            result->status);
+    fprintf(stream, "\"wall_us\":%" PRId64 ",\"user_us\":%" PRId64 ","
+            "\"sys_us\":%" PRId64 ",\"maxrss_kb\":%ld}\n",
+            result->wall_us, result->user_us, result->sys_us,
+            result->maxrss_kb);
+}
+
+// Pass on the path a worker just ran to --report and the result callback.
+static int
+result_path(larmier_ctx_t *larmier_ctx, larmier_worker_t *worker,
+            int status, int err)
+{
+    bca_t *bca = worker->bca_ctx->bca;
+    larmier_result_t result;
+    char *path;
+    uint32_t i;
+
+    path = malloc(bca->count + 1);
+    if (path == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    for (i = 0; i < bca->count; i++) {
+        path[i] = outcome_char(bca_get(bca->map, i));
+    }
+    path[i] = '\0';
+
+    result.path = path;
+    result.exit_class = exit_class(err);
+    result.err = err;
+    result.status = WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status);
+    result.wall_us = (int64_t)(worker->exit - worker->start) / 1000;
+    result.user_us = timeval_us(&worker->rusage.ru_utime);
+    result.sys_us = timeval_us(&worker->rusage.ru_stime);
+    result.maxrss_kb = worker->rusage.ru_maxrss;
+
+    if (larmier_ctx->report != NULL) {
+        report_path(larmier_ctx->report, &result);
+    }
+    if (larmier_ctx->result_cb != NULL) {
+        larmier_ctx->result_cb(&result, larmier_ctx->result_data);
+    }
+
+    free(path);
+    return 0;
+}
+
+static inline unsigned int
+prof_bucket(uint64_t ns)
+{
+    unsigned int msb;
+
+    if (ns < (1 << PROF_SUB_BITS)) {
+        return ns;
+    }
+    msb = 63 - __builtin_clzll(ns);
+
+    return ((msb - PROF_SUB_BITS + 1) << PROF_SUB_BITS) +
+           ((ns >> (msb - PROF_SUB_BITS)) & ((1 << PROF_SUB_BITS) - 1));
+}
+
+// The smallest duration which falls into a bucket.
+static inline uint64_t
+prof_bucket_min(unsigned int bucket)
+{
+    unsigned int shift = (bucket >> PROF_SUB_BITS);
+
+    if (shift == 0) {
+        return bucket;
+    }
+
+    return (uint64_t)((1 << PROF_SUB_BITS) +
+                      (bucket & ((1 << PROF_SUB_BITS) - 1))) << (shift - 1);
+}
+
+static void
+prof_add(prof_hist_t *hist, uint64_t ns)
+{
+    hist->count++;
+    hist->total += ns;
+    if (ns > hist->max) {
+        hist->max = ns;
+    }
+    hist->buckets[prof_bucket(ns)]++;
+}
+
+static uint64_t
+prof_percentile(prof_hist_t *hist, unsigned int pct)
+{
+    uint64_t rank = (hist->count * pct + 99) / 100;
+    uint64_t seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < PROF_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank && seen > 0) {
+            return prof_bucket_min(i);
+        }
+    }
+
+    return hist->max;
+}
+
+// Add a complete event to the trace (see the Trace Event Format used by
+// chrome://tracing and Perfetto). Only the run carries the path, to keep
+// traces of long explorations manageable.
+static void
+trace_event(larmier_ctx_t *larmier_ctx, larmier_worker_t *worker,
+            const char *name, uint64_t start, uint64_t end)
+{
+    FILE *stream = larmier_ctx->trace;
+    bca_t *bca = worker->bca_ctx->bca;
+    uint32_t i;
+
+    if (stream == NULL || end < start) {
+        return;
+    }
+
+    fprintf(stream, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+            "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+            larmier_ctx->trace_sep ? ",\n" : "", name, (int)getpid(),
+            (int)(worker - larmier_ctx->workers),
+            (double)(start - larmier_ctx->epoch) / 1000,
+            (double)(end - start) / 1000);
+    if (strcmp(name, phase_names[PHASE_RUN]) == 0) {
+        fprintf(stream, ",\"args\":{\"path\":\"");
+        for (i = 0; i < bca->count; i++) {
+            (void)fputc(outcome_char(bca_get(bca->map, i)), stream);
+        }
+        fprintf(stream, "\"}");
+    }
+    fprintf(stream, "}");
+    larmier_ctx->trace_sep = true;
+}
+
+// Account for the phases of the path a worker just ran. The test's lifetime
+// is split at its first output: before is mostly valgrind (and the test)
+// starting up.
+static void
+prof_path(larmier_ctx_t *larmier_ctx, larmier_worker_t *worker)
+{
+    uint64_t output = (worker->output != 0) ? worker->output : worker->ready;
+
+    prof_add(&larmier_ctx->prof[PHASE_SPAWN], worker->ready - worker->start);
+    prof_add(&larmier_ctx->prof[PHASE_STARTUP], output - worker->ready);
+    prof_add(&larmier_ctx->prof[PHASE_RUN], worker->exit - output);
+    prof_add(&larmier_ctx->prof[PHASE_DRAIN], worker->drain);
+
+    trace_event(larmier_ctx, worker, phase_names[PHASE_SPAWN], worker->start,
+                worker->ready);
+    if (output > worker->ready) {
+        trace_event(larmier_ctx, worker, phase_names[PHASE_STARTUP],
+                    worker->ready, output);
+    }
+    trace_event(larmier_ctx, worker, phase_names[PHASE_RUN], output,
+                worker->exit);
+}
+
+static void
+prof_time(char *buf, size_t len, uint64_t ns)
+{
+    if (ns < 1000) {
+        (void)snprintf(buf, len, "%" PRIu64 "ns", ns);
+    } else if (ns < 1000000) {
+        (void)snprintf(buf, len, "%.1fus", (double)ns / 1000);
+    } else if (ns < 1000000000) {
+        (void)snprintf(buf, len, "%.1fms", (double)ns / 1000000);
+    } else {
+        (void)snprintf(buf, len, "%.2fs", (double)ns / 1000000000);
+    }
+}
+
+static void
+prof_dump(larmier_ctx_t *larmier_ctx)
+{
+    static const unsigned int pcts[] = { 50, 90, 99 };
+    uint64_t wall = now_ns() - larmier_ctx->epoch;
+    prof_hist_t *hist;
+    char buf[16];
+    unsigned int i, j;
+
+    if (larmier_ctx->prof[PHASE_RUN].count == 0) {
+        return;
+    }
+
+    prof_time(buf, sizeof(buf), wall);
+    POUT("********************************\n");
+    POUT("Paths: %" PRIu64 " in %s\n", larmier_ctx->prof[PHASE_RUN].count,
+         buf);
+    if (larmier_ctx->pruned > 0) {
+        POUT("Pruned: %" PRIu64 " calls made for real\n", larmier_ctx->pruned);
+    }
+    POUT("%-10s %10s %10s %10s %10s %10s\n", "Phase", "Total", "p50", "p90",
+         "p99", "Max");
+    for (i = 0; i < PHASE_MAX; i++) {
+        hist = &larmier_ctx->prof[i];
+        prof_time(buf, sizeof(buf), hist->total);
+        POUT("%-10s %10s", phase_names[i], buf);
+        for (j = 0; j < sizeof(pcts) / sizeof(pcts[0]); j++) {
+            prof_time(buf, sizeof(buf), prof_percentile(hist, pcts[j]));
+            POUT(" %10s", buf);
+        }
+        prof_time(buf, sizeof(buf), hist->max);
+        POUT(" %10s\n", buf);
+    }
+    POUT("********************************\n");
+}
+
+// With shards, each path is explored by the shard of the first call it fails,
+// call 'n' belonging to shard 'n % shards'. Every shard explores the path with
+// no injections. Returns the first call from 'call' on which is this shard's.
+static uint32_t
+shard_next(larmier_ctx_t *larmier_ctx, uint32_t call)
+{
+    uint32_t shards = larmier_ctx->shards;
+
+    return call + (larmier_ctx->shard + shards - call % shards) % shards;
+}
+
+static int
+worker_complete(larmier_ctx_t *larmier_ctx, larmier_worker_t *worker,
+                int status, bool last, larmier_opts_t *larmier_opts)
+{
+    larmier_snap_t *snap = NULL;
+    larmier_path_t *path;
+    unsigned int val;
+    bca_t *bca;
+    char ack = 0;
+    int spool;
+    int err = 0;
+    uint32_t i, len, end, first;
+
+    // The test may have grown the bca.
+    if (bca_sync(worker->bca_ctx) == -1) {
+        err = EXIT_MASK_SYSTEM | EXIT_ERR_LARMIER;
+        goto out;
+    }
+    bca = worker->bca_ctx->bca;
+    bca_unused(bca);
+
+    // Maybe dump output and bca.
+    if (larmier_opts->debug >= 2) {
+        output_dump(worker->spool);
+    }
+    bca_dump(larmier_opts, worker->bca_ctx);
+
+    snap = snap_new(bca->map, bca->count);
+    if (snap == NULL) {
+        err = EXIT_MASK_SYSTEM | EXIT_ERR_LARMIER;
+        goto out;
+    }
+
+    // Check if valgrind encountered errors.
+    err = larmier_status(status, worker, larmier_opts);
+    if ((larmier_ctx->report != NULL || larmier_ctx->result_cb != NULL) &&
+        result_path(larmier_ctx, worker, status, err) == -1) {
+        err = EXIT_MASK_SYSTEM | EXIT_ERR_LARMIER;
+    }
+    prof_path(larmier_ctx, worker);
+    larmier_ctx->pruned += bca->pruned;
+    bca->heap_leaks = 0;
+    bca->fd_leaks = 0;
+    bca->pruned = 0;
+    if (err != 0) {
+        path = (bca->count == 0) ? path_new(NULL, 0, 0) :
+               path_new(snap, bca->count, bca_get(bca->map, bca->count - 1));
+        snap_put(snap);
+        snap = NULL;
+        if (path == NULL) {
+            err = EXIT_MASK_SYSTEM | EXIT_ERR_LARMIER;
+            goto out;
+        }
+
+        // Anything left in an exploring test's subtree comes afterwards.
+        if (!last) {
+            worker_kill(worker, larmier_opts);
+            (void)worker_reap(worker);
+        }
+        worker_finish(larmier_ctx, worker);
+
+        // The worker starts a new spool for its next path.
+        spool = worker->spool;
+        worker->spool = -1;
+        larmier_fail(larmier_ctx, path, err, spool, bca, larmier_opts);
+        return 0;
+    }
+
+    // The first call failed on this path, if any.
+    for (first = 0; first < bca->count; first++) {
+        if (bca_failed(bca_get(bca->map, first))) {
+            break;
+        }
+    }
+
+    // Queue a path with the next outcome of each call which failed, from
+    // the end of the explored prefix onwards (or from the start, for a seed).
+    // Once a stub's last outcome was taken, the real call comes next. Deeper
+    // calls end up closer to the tail, preserving DFS order. When exploring
+    // by forking, the test already took care of calls beyond the prefix.
+    len = worker->path->len;
+    i = (len > 0 && !worker->path->seed) ? len - 1 : 0;
+    end = larmier_opts->explore ? (last ? len : 0) : bca->count;
+    if (end > bca->count) {
+        end = bca->count;
+    }
+    for (; i < end; i++) {
+        val = bca_get(bca->map, i);
+        if (!bca_failed(val)) {
+            continue;
+        }
+        val = (val & BCA_LAST) ? BCA_REAL : val + 1;
+        if (larmier_ctx->shards > 1 && i == first && val == BCA_REAL) {
+            // Skip the calls whose failures are other shards'.
+            path = path_real(shard_next(larmier_ctx, i + 1));
+        } else if (larmier_ctx->shards > 1 &&
+                   first % larmier_ctx->shards != larmier_ctx->shard) {
+            continue;
+        } else {
+            path = path_new(snap, i + 1, val);
+        }
+        if (path == NULL || deque_push(&worker->deque, path) == -1) {
+            path_free(path);
+            err = EXIT_MASK_SYSTEM | EXIT_ERR_LARMIER;
+            goto out;
+        }
+    }
+
+    // Nothing failed on this path at all, use actual exit status.
+    if (first == bca->count) {
+        larmier_ctx->final_err = (EXIT_MASK_TEST | WEXITSTATUS(status));
+    }
+    snap_put(snap);
+    snap = NULL;
+
+    // Let the exploring test carry on with the next path.
+    if (!last) {
+        worker_reset(worker);
+        if (write(worker->ctlfd, &ack, sizeof(ack)) != sizeof(ack)) {
+            perror("write");
+            err = EXIT_MASK_SYSTEM | EXIT_ERR_LARMIER;
+        }
+        return err;
+    }
+
+out:
+    snap_put(snap);
+    worker_finish(larmier_ctx, worker);
+
+    return err;
+}
+
+// Complete a path whose test exited, timing the bookkeeping.
+static int
+worker_done(larmier_ctx_t *larmier_ctx, larmier_worker_t *worker,
+            int status, bool last, larmier_opts_t *larmier_opts)
+{
+    uint64_t start = now_ns();
+    uint64_t end;
+    int err;
+
+    // An exploring test's next path starts once this one is complete.
+    worker->exit = start;
+    err = worker_complete(larmier_ctx, worker, status, last, larmier_opts);
+    end = now_ns();
+
+    prof_add(&larmier_ctx->prof[PHASE_COMPLETE], end - start);
+    trace_event(larmier_ctx, worker, phase_names[PHASE_COMPLETE], start, end);
+
+    return err;
+}
+
+static int
+worker_poll(larmier_ctx_t *larmier_ctx, larmier_worker_t *worker,
+            struct pollfd *pfds, larmier_opts_t *larmier_opts)
+{
+    larmier_st_t st;
+    ssize_t bytes_read;
+    int status;
+
+    // Spool the child's stdout/stderr and valgrind's log.
+    if (pfds[0].revents != 0 || pfds[1].revents != 0) {
+        worker_drain(worker);
+
+        // Without a fork server, EOF means valgrind is exiting.
+        if (worker->pipefd == -1 && !larmier_opts->forksrv) {
+            status = worker_reap(worker);
+            return worker_done(larmier_ctx, worker, status, true,
+                               larmier_opts);
+        }
+
+        // Don't wait for the path to finish after a memcheck error.
+        if (worker->mc_abort && larmier_opts->early_abort) {
+            worker_kill(worker, larmier_opts);
+            status = worker_reap(worker);
+            return worker_done(larmier_ctx, worker, status, true,
+                               larmier_opts);
+        }
+    }
+
+    // Give up on a path which is taking too long, eg. retrying a failed call
+    // forever.
+    if (pfds[2].revents == 0) {
+        if (larmier_opts->path_timeout > 0 &&
+            now_ns() - worker->start >= larmier_opts->path_timeout) {
+            worker->timed_out = true;
+            worker_kill(worker, larmier_opts);
+            status = worker_reap(worker);
+            return worker_done(larmier_ctx, worker, status, true,
+                               larmier_opts);
+        }
+        return 0;
+    }
+
+    // Statuses are reported once the path's process exits, at which point
+    // all of its output is already in the pipe.
+    bytes_read = read(worker->stfd, &st, sizeof(st));
+    if (bytes_read == -1 && (errno == EINTR || errno == EAGAIN)) {
+        return 0;
+    }
+    if (bytes_read == sizeof(st)) {
+        worker->rusage = st.rusage;
+        worker_drain(worker);
+        return worker_done(larmier_ctx, worker, st.status,
+                           !(st.flags & LARMIER_ST_LEAF), larmier_opts);
+    }
+
+    // The test never parked (eg. no larmier_stub(true) was reached), so
+    // it ran the path itself.
+    status = worker_reap(worker);
+
+    return worker_done(larmier_ctx, worker, status, true, larmier_opts);
+}
+
+static larmier_path_t *
+worker_next_path(larmier_ctx_t *larmier_ctx, larmier_worker_t *worker)
+{
+    larmier_worker_t *victim = NULL;
+    larmier_path_t *path;
+    int i;
+
+    // Prefer the deepest path discovered by this worker.
+    path = deque_pop(&worker->deque);
+    if (path != NULL) {
+        return path;
+    }
+
+    // Otherwise steal the shallowest path of the busiest worker.
+    for (i = 0; i < larmier_ctx->nworkers; i++) {
+        if (victim == NULL || deque_len(&larmier_ctx->workers[i].deque) >
+                              deque_len(&victim->deque)) {
+            victim = &larmier_ctx->workers[i];
+        }
+    }
+
+    return deque_steal(&victim->deque);
+}
+
+// How long to wait for workers, in ms, before a timeout is due.
+static int
+loop_timeout(larmier_ctx_t *larmier_ctx, larmier_opts_t *larmier_opts)
+{
+    larmier_worker_t *worker;
+    uint64_t end = larmier_ctx->deadline;
+    uint64_t now;
+    int i;
+
+    if (larmier_opts->path_timeout > 0) {
+        for (i = 0; i < larmier_ctx->nworkers; i++) {
+            worker = &larmier_ctx->workers[i];
+            if (worker->path != NULL &&
+                (end == 0 ||
+                 worker->start + larmier_opts->path_timeout < end)) {
+                end = worker->start + larmier_opts->path_timeout;
+            }
+        }
+    }
+    if (end == 0) {
+        return -1;
+    }
+
+    now = now_ns();
+    if (end <= now) {
+        return 0;
+    }
+    if ((end - now) / 1000000 >= INT_MAX) {
+        return INT_MAX;
+    }
+
+    return (end - now + 999999) / 1000000;
+}
+
+// Hand out paths to idle workers, as long as the shared pool (if any) has
+// room. Returns the verdict once there is nothing left to run.
+static int
+loop_spawn(larmier_ctx_t *larmier_ctx, larmier_opts_t *larmier_opts)
+{
+    larmier_worker_t *worker;
+    bool starved = false;
+    int err;
+    int i;
+
+    assert(larmier_ctx != NULL);
+    assert(larmier_opts != NULL);
+    assert(larmier_opts->test_argv != NULL);
+
+    for (i = 0; i < larmier_ctx->nworkers; i++) {
+        worker = &larmier_ctx->workers[i];
+        if (worker->path != NULL) {
+            continue;
+        }
+        if (larmier_ctx->slots != NULL && *larmier_ctx->slots == 0) {
+            starved = true;
+            break;
+        }
+        worker->path = worker_next_path(larmier_ctx, worker);
+        if (worker->path == NULL) {
+            break;
+        }
+        larmier_ctx->busy++;
+        if (larmier_ctx->slots != NULL) {
+            (*larmier_ctx->slots)--;
+        }
+        err = worker_spawn(worker, larmier_opts);
+        if (err == -1) {
+            return (EXIT_MASK_SYSTEM | EXIT_ERR_LARMIER);
+        }
+    }
+
+    // Nothing running and nothing left to explore.
+    if (larmier_ctx->busy == 0 && !starved) {
+        if (larmier_ctx->fail != NULL) {
+            return larmier_ctx->fail_err;
+        }
+
+        return larmier_ctx->final_err;
+    }
+
+    return 0;
+}
+
+// Fill in what to poll for output (or a fork server status) from any running
+// worker, 3 entries per worker.
+static void
+loop_pollfds(larmier_ctx_t *larmier_ctx, struct pollfd *pfds)
+{
+    larmier_worker_t *worker;
+    int i;
+
+    for (i = 0; i < larmier_ctx->nworkers; i++) {
+        worker = &larmier_ctx->workers[i];
+        pfds[3 * i].fd = (worker->path != NULL) ? worker->pipefd : -1;
+        pfds[3 * i].events = POLLIN;
+        pfds[3 * i + 1].fd = (worker->path != NULL) ? worker->logfd : -1;
+        pfds[3 * i + 1].events = POLLIN;
+        pfds[3 * i + 2].fd = (worker->path != NULL) ? worker->stfd : -1;
+        pfds[3 * i + 2].events = POLLIN;
+    }
+}
+
+// Collect output and finished paths, once polled.
+static int
+loop_collect(larmier_ctx_t *larmier_ctx, struct pollfd *pfds,
+             larmier_opts_t *larmier_opts)
+{
+    larmier_worker_t *worker;
+    int err;
+    int i;
+
+    for (i = 0; i < larmier_ctx->nworkers; i++) {
+        worker = &larmier_ctx->workers[i];
+        if (worker->path == NULL) {
+            continue;
+        }
+        err = worker_poll(larmier_ctx, worker, &pfds[3 * i], larmier_opts);
+        if (err != 0) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+static int
+larmier_loop(larmier_ctx_t *larmier_ctx, larmier_opts_t *larmier_opts)
+{
+    struct pollfd pfds[3 * JOBS_MAX];
+    int err;
+
+    err = loop_spawn(larmier_ctx, larmier_opts);
+    if (err != 0) {
+        return err;
+    }
+
+    loop_pollfds(larmier_ctx, pfds);
+    err = poll(pfds, 3 * larmier_ctx->nworkers,
+               loop_timeout(larmier_ctx, larmier_opts));
+    if (err == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        perror("poll");
+        return (EXIT_MASK_SYSTEM | EXIT_ERR_LARMIER);
+    }
+
+    // Out of time, stop as if asked to.
+    if (larmier_ctx->deadline != 0 && now_ns() >= larmier_ctx->deadline) {
+        larmier_ctx->expired = true;
+        larmier_stop = 1;
+        return 0;
+    }
+
+    // Paths may have been killed by the same signal, don't take them as
+    // failed.
+    if (larmier_stop) {
+        return 0;
+    }
+
+    return loop_collect(larmier_ctx, pfds, larmier_opts);
+}
+
+static inline void
+bca_ctx_destroy(bca_ctx_t *bca_ctx)
+{
+    (void)munmap(bca_ctx->bca, bca_ctx->bca_len);
+    (void)shm_unlink(bca_ctx->bca_name);
+    free(bca_ctx->bca_name);
+    free(bca_ctx);
+}
+
+static inline void *
+bca_ctx_create(void)
+{
+    static unsigned int idx;    // Names must be unique within the process
+    bca_ctx_t *bca_ctx;
+    int bca_fd;
+    int err;
+
+    // Allocate context for branch control array.
+    bca_ctx = calloc(1, sizeof(*bca_ctx));
+    if (bca_ctx == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+
+    // Define unique name for bca shm entry.
+    err = asprintf(&bca_ctx->bca_name, "larmier_%u_%u", getpid(), idx++);
+    if (err == -1) {
+        perror("asprintf");
+        goto err;
+    }
+
+    // Open an shm entry for bca.
+    bca_fd = shm_open(bca_ctx->bca_name, O_CREAT | O_RDWR, 0666);
+    if (bca_fd == -1) {
+        perror("shm_open");
+        goto err_free;
+    }
+
+    // Set initial bca size, the test grows it as needed.
+    (void)ftruncate(bca_fd, LARMIER_LEN);
+    bca_ctx->bca_len = LARMIER_LEN;
+
+    // Map and zero out bca area from fd.
+    bca_ctx->bca = mmap(NULL, LARMIER_LEN, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, bca_fd, 0);
+    if (bca_ctx->bca == MAP_FAILED) {
+        perror("mmap");
+        goto err_close;
+    }
+    (void)memset(bca_ctx->bca, 0, LARMIER_LEN);
+    bca_ctx->bca->size = LARMIER_LEN;
+
+    // Done.
+    (void)close(bca_fd);
+    return bca_ctx;
+
+err_close:
+    (void)close(bca_fd);
+    (void)shm_unlink(bca_ctx->bca_name);
+
+err_free:
+    free(bca_ctx->bca_name);
+
+err:
+    free(bca_ctx);
+    return NULL;
+}
+
+static void
+larmier_ctx_destroy(larmier_ctx_t *larmier_ctx, larmier_opts_t *larmier_opts)
+{
+    larmier_worker_t *worker;
+    size_t sym;
+    int i;
+
+    for (i = 0; i < larmier_ctx->nworkers; i++) {
+        worker = &larmier_ctx->workers[i];
+
+        // Reap anything still running (eg. a parked fork server).
+        if (worker->pid != 0) {
+            worker_kill(worker, larmier_opts);
+            (void)worker_reap(worker);
+        }
+        if (worker->spool != -1) {
+            (void)close(worker->spool);
+        }
+        path_free(worker->path);
+
+        deque_destroy(&worker->deque);
+    }
+
+    path_free(larmier_ctx->fail);
+    if (larmier_ctx->fail_spool != -1) {
+        (void)close(larmier_ctx->fail_spool);
+    }
+    for (sym = 0; sym < larmier_ctx->nsyms; sym++) {
+        free(larmier_ctx->syms[sym].name);
+    }
+    free(larmier_ctx->syms);
+    if (larmier_ctx->report != NULL) {
+        (void)fclose(larmier_ctx->report);
+    }
+    if (larmier_ctx->trace != NULL) {
+        fprintf(larmier_ctx->trace, "\n]\n");
+        (void)fclose(larmier_ctx->trace);
+    }
+    free(larmier_ctx->workers);
+    free(larmier_ctx);
+}
+
+static void
+checkpoint_path(FILE *stream, const char *kind, larmier_path_t *path)
+{
+    fprintf(stream, "%s ", kind);
+    path_write(stream, path);
+    fprintf(stream, "\n");
+}
+
+// Opens a temporary file to be renamed to 'name' once written, so that
+// readers (even other larmier processes) never see it half written.
+static FILE *
+tmpfile_open(const char *name, char **tmp_name)
+{
+    FILE *stream;
+    int fd;
+
+    if (asprintf(tmp_name, "%s.XXXXXX", name) == -1) {
+        perror("asprintf");
+        return NULL;
+    }
+
+    fd = mkostemp(*tmp_name, O_CLOEXEC);
+    if (fd == -1) {
+        PERR("Unable to create '%s': %m\n", *tmp_name);
+        free(*tmp_name);
+        return NULL;
+    }
+    (void)fchmod(fd, 0644);
+
+    stream = fdopen(fd, "w");
+    if (stream == NULL) {
+        perror("fdopen");
+        (void)close(fd);
+        (void)unlink(*tmp_name);
+        free(*tmp_name);
+    }
+
+    return stream;
+}
+
+static int
+tmpfile_commit(FILE *stream, char *tmp_name, const char *name)
+{
+    int ret = 0;
+
+    if (fclose(stream) != 0 || rename(tmp_name, name) == -1) {
+        PERR("Unable to write '%s': %m\n", name);
+        (void)unlink(tmp_name);
+        ret = -1;
+    }
+    free(tmp_name);
+
+    return ret;
+}
+
+// Write every path left to explore (including those being explored) and what
+// was found so far. The file is replaced atomically, so it is always usable.
+static int
+checkpoint_write(larmier_ctx_t *larmier_ctx, const char *name)
+{
+    larmier_worker_t *worker;
+    path_deque_t *deque;
+    char *tmp_name;
+    FILE *stream;
+    size_t j;
+    int i;
+
+    stream = tmpfile_open(name, &tmp_name);
+    if (stream == NULL) {
+        return -1;
+    }
+
+    fprintf(stream, CHECKPOINT_HEADER "\n");
+    if (larmier_ctx->shards > 1) {
+        fprintf(stream, "shard %d/%d\n", larmier_ctx->shard,
+                larmier_ctx->shards);
+    }
+    fprintf(stream, "final 0x%X\n", larmier_ctx->final_err);
+    if (larmier_ctx->fail != NULL) {
+        fprintf(stream, "fail 0x%X\n", larmier_ctx->fail_err);
+        checkpoint_path(stream, "failpath", larmier_ctx->fail);
+    }
+    for (i = 0; i < larmier_ctx->nworkers; i++) {
+        worker = &larmier_ctx->workers[i];
+        if (worker->path != NULL) {
+            checkpoint_path(stream, worker->path->seed ? "seed" : "path",
+                            worker->path);
+        }
+        deque = &worker->deque;
+        for (j = deque->head; j < deque->tail; j++) {
+            checkpoint_path(stream, deque->paths[j]->seed ? "seed" : "path",
+                            deque->paths[j]);
+        }
+    }
+
+    return tmpfile_commit(stream, tmp_name, name);
+}
+
+static int
+path_cmp_desc(const void *a, const void *b)
+{
+    return path_cmp(*(larmier_path_t * const *)b, *(larmier_path_t * const *)a);
+}
+
+// Pick up an exploration from a file written by checkpoint_write(), queueing
+// its paths into 'deque'.
+static int
+checkpoint_read(larmier_ctx_t *larmier_ctx, path_deque_t *deque,
+                const char *name)
+{
+    larmier_path_t *path;
+    char *line = NULL;
+    size_t size = 0;
+    FILE *stream;
+    char *arg;
+    int ret = -1;
+
+    stream = fopen(name, "r");
+    if (stream == NULL) {
+        PERR("Unable to open checkpoint '%s': %m\n", name);
+        return -1;
+    }
+
+    if (getline(&line, &size, stream) == -1 ||
+        strcmp(line, CHECKPOINT_HEADER "\n") != 0) {
+        PERR("Invalid checkpoint '%s'\n", name);
+        goto out;
+    }
+
+    while (getline(&line, &size, stream) != -1) {
+        line[strcspn(line, "\n")] = '\0';
+        arg = strchr(line, ' ');
+        if (arg == NULL) {
+            PERR("Invalid checkpoint line '%s'\n", line);
+            goto out;
+        }
+        *arg++ = '\0';
+
+        if (strcmp(line, "final") == 0) {
+            larmier_ctx->final_err = strtol(arg, NULL, 16);
+            continue;
+        }
+        if (strcmp(line, "fail") == 0) {
+            larmier_ctx->fail_err = strtol(arg, NULL, 16);
+            continue;
+        }
+        if (strcmp(line, "shard") == 0) {
+            if (sscanf(arg, "%d/%d", &larmier_ctx->shard,
+                       &larmier_ctx->shards) != 2) {
+                PERR("Invalid checkpoint line '%s %s'\n", line, arg);
+                goto out;
+            }
+            continue;
+        }
+        if (strcmp(line, "failpath") != 0 && strcmp(line, "path") != 0 &&
+            strcmp(line, "seed") != 0) {
+            PERR("Invalid checkpoint line '%s %s'\n", line, arg);
+            goto out;
+        }
+
+        path = path_read(arg);
+        if (path == NULL) {
+            goto out;
+        }
+        if (strcmp(line, "failpath") == 0) {
+            path_free(larmier_ctx->fail);
+            larmier_ctx->fail = path;
+            continue;
+        }
+        path->seed = (strcmp(line, "seed") == 0);
+        if (deque_push(deque, path) == -1) {
+            path_free(path);
+            goto out;
+        }
+    }
+
+    // Have the worker pop paths in DFS order.
+    qsort(&deque->paths[deque->head], deque_len(deque),
+          sizeof(*deque->paths), path_cmp_desc);
+    ret = 0;
+
+out:
+    free(line);
+    (void)fclose(stream);
+
+    return ret;
+}
+
+static larmier_ctx_t *
+larmier_ctx_create(larmier_opts_t *larmier_opts, bca_ctx_t **bca_ctxs,
+                   const char *resume)
+{
+    larmier_ctx_t *larmier_ctx;
+    larmier_path_t *root;
+    int jobs = larmier_opts->jobs;
+    int i;
+
+    assert(jobs > 0 && jobs <= JOBS_MAX);
+
+    larmier_ctx = calloc(1, sizeof(*larmier_ctx));
+    if (larmier_ctx == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    larmier_ctx->final_err = EXIT_NOT_RUN;
+    larmier_ctx->fail_spool = -1;
+    larmier_ctx->epoch = now_ns();
+    larmier_ctx->shard = larmier_opts->shard;
+    larmier_ctx->shards = larmier_opts->shards;
+
+    larmier_ctx->workers = calloc(jobs, sizeof(*larmier_ctx->workers));
+    if (larmier_ctx->workers == NULL) {
+        perror("calloc");
+        goto err;
+    }
+    larmier_ctx->nworkers = jobs;
+
+    // Give each worker a branch control array context, creating those not
+    // left by earlier explorations.
+    for (i = 0; i < jobs; i++) {
+        larmier_ctx->workers[i].pipefd = -1;
+        larmier_ctx->workers[i].logfd = -1;
+        larmier_ctx->workers[i].spool = -1;
+        larmier_ctx->workers[i].ctlfd = -1;
+        larmier_ctx->workers[i].stfd = -1;
+        if (bca_ctxs[i] == NULL) {
+            bca_ctxs[i] = bca_ctx_create();
+            if (bca_ctxs[i] == NULL) {
+                goto err;
+            }
+        }
+        larmier_ctx->workers[i].bca_ctx = bca_ctxs[i];
+        larmier_ctx->workers[i].bca_ctx->bca->streams = larmier_opts->streams;
+        larmier_ctx->workers[i].bca_ctx->bca->shard = larmier_opts->shard;
+        larmier_ctx->workers[i].bca_ctx->bca->shards = larmier_opts->shards;
+    }
+
+    // Maybe carry on with a previous exploration (or load a finished one).
+    // All paths go to the first worker, from where the others steal them.
+    if (resume != NULL) {
+        if (checkpoint_read(larmier_ctx, &larmier_ctx->workers[0].deque,
+                            resume) == -1) {
+            goto err;
+        }
+        if (larmier_ctx->shard != larmier_opts->shard ||
+            larmier_ctx->shards != larmier_opts->shards) {
+            PERR("Checkpoint '%s' is for shard %d/%d\n", resume,
+                 larmier_ctx->shard, larmier_ctx->shards);
+            goto err;
+        }
+        return larmier_ctx;
+    }
+
+    // Exploration starts with an empty prefix, ie. failing the first call,
+    // or with the path given to start at. Paths after the latter in DFS order
+    // are explored as well. A shard starts at the first call which is its own.
+    if (larmier_opts->start != NULL) {
+        root = path_read(larmier_opts->start);
+    } else {
+        root = path_real(shard_next(larmier_ctx, 0));
+    }
+    if (root == NULL) {
+        goto err;
+    }
+    root->seed = (larmier_opts->start != NULL);
+    if (deque_push(&larmier_ctx->workers[0].deque, root) == -1) {
+        path_free(root);
+        goto err;
+    }
+
+    return larmier_ctx;
+
+err:
+    larmier_ctx_destroy(larmier_ctx, larmier_opts);
+    return NULL;
+}
+
+static inline uint64_t
+hash_bytes(uint64_t hash, const void *buf, size_t len)
+{
+    const uint8_t *bytes = buf;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * HASH_PRIME;
+    }
+
+    return hash;
+}
+
+// Strings are hashed with their terminator, so consecutive ones don't blur.
+static inline uint64_t
+hash_str(uint64_t hash, const char *str)
+{
+    return hash_bytes(hash, str, strlen(str) + 1);
+}
+
+// Where larmier (or liblarmier, when built as such) itself lives. 'path'
+// holds PATH_MAX bytes.
+static int
+self_path(char *path)
+{
+#ifdef LARMIER_LIB
+    Dl_info info;
+
+    if (dladdr((void *)self_path, &info) == 0 || info.dli_fname == NULL ||
+        realpath(info.dli_fname, path) == NULL) {
+        PERR("Unable to locate liblarmier\n");
+        return -1;
+    }
+#else
+    ssize_t len;
+
+    len = readlink("/proc/self/exe", path, PATH_MAX - 1);
+    if (len == -1) {
+        perror("readlink");
+        return -1;
+    }
+    path[len] = '\0';
+#endif
+
+    return 0;
+}
+
+static int
+hash_file(uint64_t *hash, const char *name)
+{
+    char buf[READBUF_SIZE];
+    ssize_t len;
+    int fd;
+
+    fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        PERR("Unable to open '%s': %m\n", name);
+        return -1;
+    }
+
+    *hash = hash_str(*hash, name);
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        *hash = hash_bytes(*hash, buf, len);
+    }
+    if (len == -1) {
+        PERR("Unable to read '%s': %m\n", name);
+    }
+    (void)close(fd);
+
+    return (len == -1) ? -1 : 0;
+}
+
+// Returns the dynamic loader an executable asks for, NULL if none (eg. it is
+// statically linked).
+static char *
+elf_interp(const char *name)
+{
+    ElfW(Ehdr) ehdr;
+    ElfW(Phdr) phdr;
+    char *interp = NULL;
+    int fd;
+    int i;
+
+    fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+        memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr.e_phentsize != sizeof(phdr)) {
+        goto out;
+    }
+
+    for (i = 0; i < ehdr.e_phnum; i++) {
+        if (pread(fd, &phdr, sizeof(phdr),
+                  ehdr.e_phoff + i * sizeof(phdr)) != sizeof(phdr)) {
+            break;
+        }
+        if (phdr.p_type != PT_INTERP || phdr.p_filesz > PATH_MAX) {
+            continue;
+        }
+        interp = calloc(1, phdr.p_filesz + 1);
+        if (interp != NULL &&
+            pread(fd, interp, phdr.p_filesz,
+                  phdr.p_offset) != (ssize_t)phdr.p_filesz) {
+            free(interp);
+            interp = NULL;
+        }
+        break;
+    }
+
+out:
+    (void)close(fd);
+
+    return interp;
+}
+
+static int
+elf_sym_cmp(const void *a, const void *b)
+{
+    const elf_sym_t *sa = a;
+    const elf_sym_t *sb = b;
+
+    return (sa->addr > sb->addr) - (sa->addr < sb->addr);
+}
+
+// Load the functions of an executable from its symbol table (or, if it was
+// stripped, its dynamic one), sorted by address.
+static int
+elf_syms(const char *name, elf_sym_t **syms_out, size_t *nsyms_out)
+{
+    const ElfW(Ehdr) *ehdr;
+    const ElfW(Shdr) *shdr;
+    const ElfW(Shdr) *symtab = NULL;
+    const ElfW(Shdr) *strtab;
+    const ElfW(Sym) *sym;
+    elf_sym_t *syms = NULL;
+    size_t nsyms = 0;
+    struct stat st;
+    uint8_t *elf = MAP_FAILED;
+    size_t i;
+    int fd;
+    int err = -1;
+
+    fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1 ||
+        (size_t)st.st_size < sizeof(*ehdr)) {
+        goto out;
+    }
+    elf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (elf == MAP_FAILED) {
+        goto out;
+    }
+
+    ehdr = (const ElfW(Ehdr) *)elf;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr->e_shentsize != sizeof(*shdr) || ehdr->e_shoff > st.st_size ||
+        ehdr->e_shnum > (st.st_size - ehdr->e_shoff) / sizeof(*shdr)) {
+        goto out;
+    }
+    shdr = (const ElfW(Shdr) *)(elf + ehdr->e_shoff);
+    for (i = 0; i < ehdr->e_shnum; i++) {
+        if (shdr[i].sh_type == SHT_SYMTAB ||
+            (shdr[i].sh_type == SHT_DYNSYM && symtab == NULL)) {
+            symtab = &shdr[i];
+        }
+    }
+    if (symtab == NULL || symtab->sh_link >= ehdr->e_shnum ||
+        symtab->sh_entsize != sizeof(*sym) ||
+        symtab->sh_offset > st.st_size ||
+        symtab->sh_size > st.st_size - symtab->sh_offset) {
+        goto out;
+    }
+    strtab = &shdr[symtab->sh_link];
+    if (strtab->sh_offset > st.st_size ||
+        strtab->sh_size > st.st_size - strtab->sh_offset) {
+        goto out;
+    }
+
+    syms = calloc(symtab->sh_size / sizeof(*sym), sizeof(*syms));
+    if (syms == NULL) {
+        perror("calloc");
+        goto out;
+    }
+    sym = (const ElfW(Sym) *)(elf + symtab->sh_offset);
+    for (i = 0; i < symtab->sh_size / sizeof(*sym); i++) {
+        if (ELF64_ST_TYPE(sym[i].st_info) != STT_FUNC ||
+            sym[i].st_shndx == SHN_UNDEF || sym[i].st_value == 0 ||
+            sym[i].st_name >= strtab->sh_size) {
+            continue;
+        }
+        syms[nsyms].name = strndup((const char *)elf + strtab->sh_offset +
+                                   sym[i].st_name,
+                                   strtab->sh_size - sym[i].st_name);
+        if (syms[nsyms].name == NULL) {
+            perror("strndup");
+            goto out;
+        }
+        syms[nsyms].addr = sym[i].st_value;
+        syms[nsyms].size = sym[i].st_size;
+        nsyms++;
+    }
+    qsort(syms, nsyms, sizeof(*syms), elf_sym_cmp);
+
+    *syms_out = syms;
+    *nsyms_out = nsyms;
+    syms = NULL;
+    nsyms = 0;
+    err = 0;
+
+out:
+    for (i = 0; i < nsyms; i++) {
+        free(syms[i].name);
+    }
+    free(syms);
+    if (elf != MAP_FAILED) {
+        (void)munmap(elf, st.st_size);
+    }
+    if (fd != -1) {
+        (void)close(fd);
+    }
+
+    return err;
+}
+
+// Returns the function of the test at 'addr' (relative to where it was
+// loaded), NULL if unknown. Symbols are loaded on first use and kept.
+static const elf_sym_t *
+sym_lookup(larmier_ctx_t *larmier_ctx, larmier_opts_t *larmier_opts,
+           uint64_t addr)
+{
+    const elf_sym_t *sym;
+    size_t lo = 0;
+    size_t hi;
+    size_t mid;
+
+    if (!larmier_ctx->syms_loaded) {
+        larmier_ctx->syms_loaded = true;
+        (void)elf_syms(larmier_opts->test, &larmier_ctx->syms,
+                       &larmier_ctx->nsyms);
+    }
+
+    // Find the last function starting at or before 'addr'.
+    hi = larmier_ctx->nsyms;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (larmier_ctx->syms[mid].addr <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return NULL;
+    }
+    sym = &larmier_ctx->syms[lo - 1];
+    if (sym->size != 0 && addr >= sym->addr + sym->size) {
+        return NULL;
+    }
+
+    return sym;
+}
+
+// Print where the failing path's failures were injected. Addresses are
+// relative to the test program, eg. for addr2line.
+static void
+traces_dump(larmier_ctx_t *larmier_ctx, larmier_opts_t *larmier_opts)
+{
+    const elf_sym_t *sym;
+    bca_trace_t *trace;
+    uint64_t addr;
+    unsigned int i, j;
+
+    for (i = 0; i < larmier_ctx->fail_ntraces; i++) {
+        trace = &larmier_ctx->fail_traces[i];
+        POUT("Injected '%c' at call %" PRIu32 ":\n",
+             outcome_char(path_get(larmier_ctx->fail, trace->slot)),
+             trace->slot);
+        for (j = 0; j < trace->nframes && j < BCA_FRAMES; j++) {
+            addr = trace->frames[j] - trace->base;
+            sym = sym_lookup(larmier_ctx, larmier_opts, addr);
+            if (sym != NULL) {
+                POUT("    #%u 0x%" PRIx64 " %s+0x%" PRIx64 "\n", j, addr,
+                     sym->name, addr - sym->addr);
+            } else {
+                POUT("    #%u 0x%" PRIx64 "\n", j, addr);
+            }
+        }
+    }
+}
+
+// Hash every shared object the test loads, as listed by its dynamic loader
+// with the environment the test runs with.
+static int
+hash_dsos(uint64_t *hash, larmier_opts_t *larmier_opts)
+{
+    char *envp[3] = { NULL, NULL, NULL };
+    char *argv[4];
+    char *interp;
+    char *line = NULL;
+    size_t line_size = 0;
+    char *dso;
+    FILE *stream;
+    int pipefd[2];
+    int status;
+    pid_t pid;
+    int ret = -1;
+
+    interp = elf_interp(larmier_opts->test);
+    if (interp == NULL) {
+        return 0;
+    }
+
+    if (setup_preload(envp, larmier_opts) == -1) {
+        goto out;
+    }
+    if (pipe2(pipefd, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        goto out;
+    }
+
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        (void)close(pipefd[0]);
+        (void)close(pipefd[1]);
+        goto out;
+    }
+    if (pid == 0) {
+        argv[0] = interp;
+        argv[1] = "--list";
+        argv[2] = larmier_opts->test;
+        argv[3] = NULL;
+        if (dup2(pipefd[1], STDOUT_FILENO) != -1) {
+            (void)execve(interp, argv, envp);
+        }
+        _exit(EXIT_FAILURE);
+    }
+    (void)close(pipefd[1]);
+
+    stream = fdopen(pipefd[0], "r");
+    if (stream == NULL) {
+        perror("fdopen");
+        (void)close(pipefd[0]);
+        (void)waitpid(pid, NULL, 0);
+        goto out;
+    }
+
+    // Lines are like "libc.so.6 => /lib/libc.so.6 (0x...)", or just the path
+    // for the loader itself. Others (eg. the vDSO) have nothing to hash.
+    ret = 0;
+    while (getline(&line, &line_size, stream) != -1) {
+        dso = strstr(line, "=> ");
+        dso = (dso != NULL) ? dso + 3 : line + strspn(line, " \t");
+        if (*dso != '/') {
+            continue;
+        }
+        dso[strcspn(dso, " \n")] = '\0';
+        if (ret == 0 && hash_file(hash, dso) == -1) {
+            ret = -1;
+        }
+    }
+    (void)fclose(stream);
+
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        PERR("Unable to list the libraries of '%s'\n", larmier_opts->test);
+        ret = -1;
+    }
+
+out:
+    free(line);
+    free(envp[0]);
+    free(envp[1]);
+    free(interp);
+
+    return ret;
+}
+
+// Returns the name of the result cache entry for this exploration. Its key
+// covers everything the verdict depends on: larmier, the options, valgrind
+// and its suppressions, the test and every library it loads.
+static char *
+cache_entry(larmier_opts_t *larmier_opts)
+{
+    uint64_t hash = HASH_BASIS;
+    char self[PATH_MAX];
+    char opts[64];
+    char *entry;
+    char **arg;
+
+    // Verdicts may change with larmier itself, not only with its version.
+    hash = hash_str(hash, VERSION);
+    if (self_path(self) == -1 || hash_file(&hash, self) == -1) {
+        return NULL;
+    }
+    (void)snprintf(opts, sizeof(opts), "%d %d/%d %d %d %d %" PRIu64,
+                   larmier_opts->backend, larmier_opts->shard,
+                   larmier_opts->shards, larmier_opts->early_abort,
+                   larmier_opts->dedup, larmier_opts->streams,
+                   larmier_opts->path_timeout);
+    hash = hash_str(hash, opts);
+    hash = hash_str(hash, (larmier_opts->start != NULL) ?
+                          larmier_opts->start : "");
+
+    for (arg = larmier_opts->test_argv; *arg != NULL; arg++) {
+        // Valgrind complains about missing suppressions by itself.
+        hash = hash_str(hash, *arg);
+        if (strncmp(*arg, "--suppressions=", 15) == 0 &&
+            access(*arg + 15, F_OK) == 0 &&
+            hash_file(&hash, *arg + 15) == -1) {
+            return NULL;
+        }
+    }
+    if (larmier_opts->backend == BACKEND_VALGRIND &&
+        hash_file(&hash, larmier_opts->test_argv[0]) == -1) {
+        return NULL;
+    }
+    if (hash_file(&hash, larmier_opts->test) == -1) {
+        return NULL;
+    }
+    if (larmier_opts->stubslib != NULL &&
+        hash_file(&hash, larmier_opts->stubslib) == -1) {
+        return NULL;
+    }
+    if (larmier_opts->tracklib != NULL &&
+        hash_file(&hash, larmier_opts->tracklib) == -1) {
+        return NULL;
+    }
+    if (hash_dsos(&hash, larmier_opts) == -1) {
+        return NULL;
+    }
+
+    if (mkdir(larmier_opts->cache, 0777) == -1 && errno != EEXIST) {
+        PERR("Unable to create '%s': %m\n", larmier_opts->cache);
+        return NULL;
+    }
+    if (asprintf(&entry, "%s/%016" PRIx64, larmier_opts->cache, hash) == -1) {
+        perror("asprintf");
+        return NULL;
+    }
+
+    return entry;
+}
+
+static int
+cache_file_cmp(const void *a, const void *b)
+{
+    const cache_file_t *fa = a;
+    const cache_file_t *fb = b;
+
+    if (fa->mtime.tv_sec != fb->mtime.tv_sec) {
+        return (fa->mtime.tv_sec < fb->mtime.tv_sec) ? -1 : 1;
+    }
+    if (fa->mtime.tv_nsec != fb->mtime.tv_nsec) {
+        return (fa->mtime.tv_nsec < fb->mtime.tv_nsec) ? -1 : 1;
+    }
+
+    return 0;
+}
+
+// Remove the least recently used entries (and their output) until the cache
+// fits in its size. Other larmier processes may be doing the same.
+static void
+cache_evict(larmier_opts_t *larmier_opts)
+{
+    cache_file_t *files = NULL;
+    cache_file_t *tmp;
+    struct dirent *dent;
+    struct stat st;
+    size_t nfiles = 0;
+    size_t i;
+    off_t total = 0;
+    char out[sizeof(files->name) + 4];
+    DIR *dir;
+    int dfd;
+
+    dir = opendir(larmier_opts->cache);
+    if (dir == NULL) {
+        PERR("Unable to open '%s': %m\n", larmier_opts->cache);
+        return;
+    }
+    dfd = dirfd(dir);
+
+    while ((dent = readdir(dir)) != NULL) {
+        if (strlen(dent->d_name) != sizeof(files->name) - 1 ||
+            strspn(dent->d_name, "0123456789abcdef") !=
+                sizeof(files->name) - 1 ||
+            fstatat(dfd, dent->d_name, &st, 0) == -1) {
+            continue;
+        }
+        tmp = realloc(files, (nfiles + 1) * sizeof(*files));
+        if (tmp == NULL) {
+            perror("realloc");
+            goto out;
+        }
+        files = tmp;
+        (void)strcpy(files[nfiles].name, dent->d_name);
+        files[nfiles].size = st.st_size;
+        files[nfiles].mtime = st.st_mtim;
+        (void)snprintf(out, sizeof(out), "%s.out", files[nfiles].name);
+        if (fstatat(dfd, out, &st, 0) == 0) {
+            files[nfiles].size += st.st_size;
+        }
+        total += files[nfiles].size;
+        nfiles++;
+    }
+
+    qsort(files, nfiles, sizeof(*files), cache_file_cmp);
+    for (i = 0; i < nfiles && (size_t)total > larmier_opts->cache_size; i++) {
+        (void)snprintf(out, sizeof(out), "%s.out", files[i].name);
+        if ((unlinkat(dfd, files[i].name, 0) == -1 && errno != ENOENT) ||
+            (unlinkat(dfd, out, 0) == -1 && errno != ENOENT)) {
+            PERR("Unable to evict '%s/%s': %m\n", larmier_opts->cache,
+                 files[i].name);
+        }
+        total -= files[i].size;
+    }
+
+out:
+    free(files);
+    (void)closedir(dir);
+}
+
+// Store the verdict of a finished exploration, with what its failing path
+// printed. The output goes first: an entry is only found once complete.
+static void
+cache_put(larmier_ctx_t *larmier_ctx, const char *entry,
+          larmier_opts_t *larmier_opts)
+{
+    char buf[READBUF_SIZE];
+    char *out = NULL;
+    char *tmp_name;
+    FILE *stream;
+    ssize_t len;
+    off_t off = 0;
+
+    if (larmier_ctx->fail_spool != -1) {
+        if (asprintf(&out, "%s.out", entry) == -1) {
+            perror("asprintf");
+            return;
+        }
+        stream = tmpfile_open(out, &tmp_name);
+        if (stream == NULL) {
+            goto out;
+        }
+        while ((len = pread(larmier_ctx->fail_spool, buf, sizeof(buf),
+                            off)) > 0) {
+            (void)fwrite(buf, 1, len, stream);
+            off += len;
+        }
+        if (tmpfile_commit(stream, tmp_name, out) == -1) {
+            goto out;
+        }
+    }
+
+    if (checkpoint_write(larmier_ctx, entry) == 0) {
+        cache_evict(larmier_opts);
+    }
+
+out:
+    free(out);
+}
+
+// Load the verdict of an exploration from the cache, if it is there.
+static larmier_ctx_t *
+cache_get(const char *entry, larmier_opts_t *larmier_opts,
+          bca_ctx_t **bca_ctxs)
+{
+    larmier_ctx_t *larmier_ctx;
+    char *out;
+
+    if (access(entry, F_OK) == -1) {
+        return NULL;
+    }
+    larmier_ctx = larmier_ctx_create(larmier_opts, bca_ctxs, entry);
+    if (larmier_ctx == NULL) {
+        return NULL;
+    }
+
+    // Mark it as recently used.
+    (void)utimensat(AT_FDCWD, entry, NULL, 0);
+
+    if (larmier_ctx->fail != NULL &&
+        asprintf(&out, "%s.out", entry) != -1) {
+        larmier_ctx->fail_spool = open(out, O_RDONLY | O_CLOEXEC);
+        free(out);
+    }
+
+    if (larmier_opts->debug > 0) {
+        POUT("Cached result: '%s'\n", entry);
+    }
+
+    return larmier_ctx;
+}
+
+static void
+larmier_sighandler(int sig)
+{
+    (void)sig;
+    larmier_stop = 1;
+}
+
+// Open what an exploration writes as it goes, and set its deadline.
+static int
+explore_setup(larmier_ctx_t *larmier_ctx, larmier_opts_t *larmier_opts)
+{
+    // Maybe keep a record of every path, carrying on with a resumed one.
+    if (larmier_opts->report != NULL) {
+        larmier_ctx->report = fopen(larmier_opts->report,
+                                    (larmier_opts->resume != NULL) ? "ae" :
+                                                                     "we");
+        if (larmier_ctx->report == NULL) {
+            PERR("Unable to open '%s': %m\n", larmier_opts->report);
+            return -1;
+        }
+    }
+
+    // Maybe keep a timeline of every path.
+    if (larmier_opts->trace != NULL) {
+        larmier_ctx->trace = fopen(larmier_opts->trace, "we");
+        if (larmier_ctx->trace == NULL) {
+            PERR("Unable to open '%s': %m\n", larmier_opts->trace);
+            return -1;
+        }
+        fprintf(larmier_ctx->trace, "[\n");
+    }
+
+    // Give up (keeping what was found so far) after a while, if asked to.
+    if (larmier_opts->timeout > 0) {
+        larmier_ctx->deadline = now_ns() + larmier_opts->timeout;
+    }
+
+    return 0;
+}
+
+// The verdict of an exploration which stopped with 'err'.
+static int
+explore_verdict(larmier_ctx_t *larmier_ctx, int err)
+{
+    if (larmier_ctx->expired) {
+        // Report the first failure found, if any, although the unexplored
+        // paths may hold an earlier one.
+        PERR("Exploration timed out\n");
+        err = (larmier_ctx->fail != NULL) ? larmier_ctx->fail_err :
+                                            EXIT_MASK_SYSTEM | EXIT_ERR_TIMEOUT;
+    } else if (larmier_stop) {
+        PERR("Exploration interrupted\n");
+        err = EXIT_MASK_SYSTEM | EXIT_ERR_LARMIER;
+    }
+
+    return err;
+}
+
+static void
+explore_dump(larmier_ctx_t *larmier_ctx, larmier_opts_t *larmier_opts,
+             int err)
+{
+    if (larmier_opts->debug == 0) {
+        return;
+    }
+
+    // Report where the time went.
+    prof_dump(larmier_ctx);
+
+    // Report which path failed, and what it printed.
+    if (larmier_ctx->fail != NULL) {
+        path_dump(larmier_ctx->fail);
+        traces_dump(larmier_ctx, larmier_opts);
+        if (larmier_opts->debug == 1) {
+            output_dump(larmier_ctx->fail_spool);
+        }
+    }
+
+    POUT("Larmier exit status: 0x%X\n", err);
+}
+
+// Explore the test in 'larmier_opts', returning its verdict (or -1 if the
+// exploration didn't start). Signal dispositions are restored on return.
+static int
+explore(larmier_opts_t *larmier_opts, bca_ctx_t **bca_ctxs,
+        larmier_result_cb_t result_cb, void *result_data)
+{
+    larmier_ctx_t *larmier_ctx = NULL;
+    sighandler_t sigint = SIG_ERR;
+    sighandler_t sigterm = SIG_ERR;
+    sighandler_t sigpipe;
+    time_t checkpoint_time;
+    char *entry = NULL;
+    bool hit = false;
+    int err = -1;
+
+    assert(larmier_opts != NULL);
+    assert(larmier_opts->test_argv != NULL);
+    assert(bca_ctxs != NULL);
+
+    // Don't die writing to a fork server which went away.
+    sigpipe = signal(SIGPIPE, SIG_IGN);
+
+    // Checkpoint before stopping, if asked to stop.
+    larmier_stop = 0;
+    if (larmier_opts->checkpoint != NULL) {
+        sigint = signal(SIGINT, larmier_sighandler);
+        sigterm = signal(SIGTERM, larmier_sighandler);
+    }
+
+    // Maybe this exploration was done before. An unusable cache is bypassed.
+    if (larmier_opts->cache != NULL && larmier_opts->resume == NULL) {
+        entry = cache_entry(larmier_opts);
+        if (entry == NULL) {
+            PERR("Not using the result cache\n");
+        } else {
+            larmier_ctx = cache_get(entry, larmier_opts, bca_ctxs);
+            hit = (larmier_ctx != NULL);
+        }
+    }
+
+    // Create a context with a branch control array per worker.
+    if (larmier_ctx == NULL) {
+        larmier_ctx = larmier_ctx_create(larmier_opts, bca_ctxs,
+                                         larmier_opts->resume);
+        if (larmier_ctx == NULL) {
+            goto out;
+        }
+    }
+    larmier_ctx->result_cb = result_cb;
+    larmier_ctx->result_data = result_data;
+    if (explore_setup(larmier_ctx, larmier_opts) == -1) {
+        goto out;
+    }
+
+    // Loop exploring branches, checkpointing every now and then.
+    err = 0;
+    checkpoint_time = time(NULL) + CHECKPOINT_INTERVAL;
+    while ((err & EXIT_MASK) == 0 && !larmier_stop) {
+        err = larmier_loop(larmier_ctx, larmier_opts);
+        if (larmier_opts->checkpoint != NULL &&
+            time(NULL) >= checkpoint_time) {
+            (void)checkpoint_write(larmier_ctx, larmier_opts->checkpoint);
+            checkpoint_time = time(NULL) + CHECKPOINT_INTERVAL;
+        }
+    }
+
+    // Leave a checkpoint of where we stopped (or of the final result).
+    if (larmier_opts->checkpoint != NULL) {
+        (void)checkpoint_write(larmier_ctx, larmier_opts->checkpoint);
+    }
+    err = explore_verdict(larmier_ctx, err);
+
+    // Cache the verdict, unless larmier failed to reach it.
+    if (entry != NULL && !hit && !larmier_stop &&
+        err != (EXIT_MASK_SYSTEM | EXIT_ERR_LARMIER)) {
+        cache_put(larmier_ctx, entry, larmier_opts);
+    }
+    explore_dump(larmier_ctx, larmier_opts, err);
+
+out:
+    // Clean up.
+    if (larmier_ctx != NULL) {
+        larmier_ctx_destroy(larmier_ctx, larmier_opts);
+    }
+    free(entry);
+
+    (void)signal(SIGPIPE, sigpipe);
+    if (sigint != SIG_ERR) {
+        (void)signal(SIGINT, sigint);
+    }
+    if (sigterm != SIG_ERR) {
+        (void)signal(SIGTERM, sigterm);
+    }
+
+    return err;
+}
+
+#ifndef LARMIER_LIB
+// Combine the final checkpoints of all shards of an exploration into the
+// verdict of exploring it in one go.
+static int
+larmier_merge(int nfiles, char **files)
+{
+    larmier_ctx_t merged = { .final_err = EXIT_NOT_RUN, .fail_spool = -1 };
+    larmier_ctx_t shard;
+    path_deque_t deque;
+    bool *seen = NULL;
+    int err = EXIT_NOT_RUN;
+    int i;
+
+    for (i = 0; i < nfiles; i++) {
+        shard = (larmier_ctx_t){ .final_err = EXIT_NOT_RUN, .fail_spool = -1,
+                                 .shards = 1 };
+        (void)memset(&deque, 0, sizeof(deque));
+        if (checkpoint_read(&shard, &deque, files[i]) == -1) {
+            goto out;
+        }
+        if (deque_len(&deque) > 0) {
+            PERR("Shard '%s' is unfinished\n", files[i]);
+            deque_destroy(&deque);
+            path_free(shard.fail);
+            goto out;
+        }
+        deque_destroy(&deque);
+
+        // All files must come from different shards of the same split.
+        if (seen == NULL) {
+            merged.shards = shard.shards;
+            seen = calloc(merged.shards, sizeof(*seen));
+            if (seen == NULL) {
+                perror("calloc");
+                path_free(shard.fail);
+                goto out;
+            }
+        }
+        if (shard.shards != merged.shards || shard.shard < 0 ||
+            shard.shard >= shard.shards || seen[shard.shard]) {
+            PERR("Shard '%s' doesn't belong with the others\n", files[i]);
+            path_free(shard.fail);
+            goto out;
+        }
+        seen[shard.shard] = true;
+
+        if (shard.final_err != EXIT_NOT_RUN) {
+            merged.final_err = shard.final_err;
+        }
+        if (shard.fail != NULL &&
+            (merged.fail == NULL || path_cmp(shard.fail, merged.fail) < 0)) {
+            path_free(merged.fail);
+            merged.fail = shard.fail;
+            merged.fail_err = shard.fail_err;
+        } else {
+            path_free(shard.fail);
+        }
+    }
+
+    for (i = 0; i < merged.shards; i++) {
+        if (!seen[i]) {
+            PERR("Shard %d/%d is missing\n", i, merged.shards);
+            goto out;
+        }
+    }
+
+    // Same as a single exploration would have reported.
+    err = (merged.fail != NULL) ? merged.fail_err : merged.final_err;
+    if (merged.fail != NULL) {
+        path_dump(merged.fail);
+    }
+    POUT("Larmier exit status: 0x%X\n", err);
+
+out:
+    path_free(merged.fail);
+    free(seen);
+
+    return (err & ~EXIT_MASK);
+}
+#endif /* LARMIER_LIB */
+
+static char *
+which(const char *name)
+{
+    char *spath, *spath_iter;
+    char *exe = NULL;
+
+    assert(name != NULL);
+
+    // Fetch PATH from environ.
+    spath = getenv("PATH");
+    if (spath == NULL) {
+        goto out;
+    }
+
+    // Copy environ to our heap for mangling.
+    spath_iter = spath = strdup(spath);
+    if (spath_iter == NULL) {
+        goto out;
+    }
+    // nb. the above keeps the copy in 'spath' for free()ing.
+
+    // Iterate over PATH searching for the executable.
+    while ((spath_iter = strtok(spath_iter, ":")) != NULL) {
+        // Allocate an 'exe' string with a full path to the executable.
+        if (asprintf(&exe, "%s/%s", spath_iter, name) == -1) {
+            perror("asprintf");
+            exe = NULL;
+            goto out;
+        }
+
+        // Check if there's an executable valgrind at 'exe'.
+        if (access(exe, X_OK) == 0) {
+            // Found.
+            goto out;
+        }
+
+        // Not found. Adjust variables for next iteration.
+        free(exe);
+        exe = NULL;
+        spath_iter = NULL;
+    }
+
+out:
+    free(spath);
+    return exe;
+}
+
+static char *
+valgrind_get(const char *upath)
+{
+    // Check user-supplied path.
+    if (upath != NULL) {
+        if (access(upath, X_OK) == -1) {
+            return NULL;
+        }
+        return strdup(upath);
+    }
+
+    // Lookup 'valgrind' in system path.
+    return which("valgrind");
+}
+
+// The leak tracker is installed along with larmier (or liblarmier), or lives
+// next to it in a build tree.
+static char *
+tracklib_get(void)
+{
+    char exe[PATH_MAX];
+    char *lib = NULL;
+
+    if (self_path(exe) == -1) {
+        return NULL;
+    }
+
+    if (asprintf(&lib, "%s/%s", dirname(exe), TRACKLIB) == -1) {
+        perror("asprintf");
+        return NULL;
+    }
+    if (access(lib, R_OK) == 0) {
+        return lib;
+    }
+    free(lib);
+
+    if (asprintf(&lib, "%s/../lib/%s", exe, TRACKLIB) == -1) {
+        perror("asprintf");
+        return NULL;
+    }
+    if (access(lib, R_OK) == 0) {
+        return lib;
+    }
+    free(lib);
+
+    return NULL;
+}
+
+static void
+help (char *argv0)
+{
+    assert(argv0 != NULL);
+
+    PERR("LARMIER %s\n", VERSION);
+    PERR("Usage: %s [ opts ] < cmd [ args ... ] >\n", argv0);
+    PERR("   Valid opts:\n");
+    PERR("       -h              Display this help and exit\n");
+    PERR("       -d[d...]        Increase debug level\n");
+    PERR("       -v <valgrind>   Path to valgrind (default: search $PATH)\n");
+    PERR("       -b, --backend <none|sanitizer|track|valgrind>\n");
+    PERR("                       How to check tests (default: valgrind)\n");
+    PERR("       -l <stubs_lib>  Name of stubs shared library\n");
+    PERR("       -j <jobs>       Number of paths to explore in parallel\n");
+    PERR("       -f              Fork paths from a parked test (fork server)\n");
+    PERR("       -x              Fork the test at each call beyond the path\n");
+    PERR("       -e, --early-abort\n");
+    PERR("                       Kill paths on their first memcheck error\n");
+    PERR("       -c, --checkpoint <file>\n");
+    PERR("                       Save progress to <file> every %ds and on exit\n",
+         CHECKPOINT_INTERVAL);
+    PERR("       -r, --resume <file>\n");
+    PERR("                       Resume the exploration saved in <file>\n");
+    PERR("       -s, --start <path>\n");
+    PERR("                       Start exploring at <path> (eg. '01a1')\n");
+    PERR("       --shard <i>/<n> Only explore shard <i> (from 0) out of <n>\n");
+    PERR("       --cache <dir>   Keep (and reuse) verdicts in <dir>\n");
+    PERR("       --cache-size <MiB>\n");
+    PERR("                       Evict old verdicts beyond (default: %d)\n",
+         CACHE_SIZE);
+    PERR("       --report <file> Write a JSON line per path to <file>\n");
+    PERR("       --trace <file>  Write a timeline of all paths to <file>\n");
+    PERR("       --path-timeout <secs>\n");
+    PERR("                       Kill paths running longer, failing them\n");
+    PERR("       --timeout <secs>\n");
+    PERR("                       Stop exploring after <secs>, reporting the\n");
+    PERR("                       first failure found so far\n");
+    PERR("       --dedup         Don't fail a call site again until another\n");
+    PERR("                       call fails (eg. in loops)\n");
+    PERR("       --streams <n>   Number the calls of each of the first <n>\n");
+    PERR("                       threads apart, in creation order\n");
+    PERR("Usage: %s merge <checkpoint> [ ... ]\n", argv0);
+    PERR("   Combine the checkpoints left by all shards of an exploration\n");
+    PERR("Usage: %s [ opts ] --batch <manifest>\n", argv0);
+    PERR("   Explore the tests in <manifest>, one per line with its own opts,\n");
+    PERR("   sharing <jobs> workers\n");
+}
+
+static void
+test_argv_dump(char **test_argv) {
+    char **tmp;
+
+    if (test_argv == NULL) {
+        return;
+    }
+
+    for (tmp = test_argv; *tmp != NULL; tmp++) {
+        POUT("'%s'", *tmp);
+        if (*(tmp+1) != NULL) {
+            POUT(" ");
+        }
+    }
+    POUT("\n");
+}
+
+static void
+test_argv_destroy(char **test_argv) {
+    char **tmp;
+
+    if (test_argv == NULL) {
+        return;
+    }
+
+    for (tmp = test_argv; *tmp != NULL; tmp++) {
+        free(*tmp);
+    }
+
+    free(test_argv);
+}
+
+// Builds the argv to execute the test with. Unless 'valgrind' is given, the
+// test is executed directly.
+static char **
+test_argv_setup(const char *valgrind, const char *stubslib,
+                int argc, char **argv)
+{
+    char **test_argv;
+    int valg_args;
+    int i;
+
+    assert(argc > 0);
+    assert(argv != NULL);
+
+#define VALG_ARGDUP(i, ...)                             \
+    do {                                                \
+        int err;                                        \
+        err = asprintf(&test_argv[i], __VA_ARGS__);     \
+        if (err == -1) {                                \
+            perror("asprintf");                         \
+            test_argv[i] = NULL;                        \
+            goto err;                                   \
+        }                                               \
+    } while (0)
+
+#define VALG_ARGS 10
+    // Determine exact number of valgrind args.
+    valg_args = VALG_ARGS;
+    if (valgrind == NULL) {
+        valg_args = 0;
+    } else if (stubslib == NULL) {
+        valg_args--;
+    }
+
+    // Allocate new argv array for valgrind and the test.
+    test_argv = calloc(1, sizeof(char *) * (valg_args + argc + 1));
+    if (test_argv == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    if (valgrind == NULL) {
+        goto test;
+    }
+
+    // Fill in argv array with valgrind-related entries.
+    VALG_ARGDUP(0, "%s", valgrind);
+    VALG_ARGDUP(1, "--track-fds=yes");
+    VALG_ARGDUP(2, "--leak-check=full");
+    VALG_ARGDUP(3, "--show-leak-kinds=all");
+    VALG_ARGDUP(4, "--error-exitcode=%d", EXIT_ERR_VALGRIND);
+    VALG_ARGDUP(5, "--suppressions=dlsym.supp");
+    VALG_ARGDUP(6, "--track-origins=yes");
+    VALG_ARGDUP(7, "--fair-sched=yes");
+    VALG_ARGDUP(8, "--log-fd=%d", VALGRIND_LOG_FD);
+    if (stubslib != NULL) {
+        VALG_ARGDUP(9, "--soname-synonyms=somalloc=%s", stubslib);
+    }
+
+test:
+    // Fill in argv array with test-related entries.
+    for (i = 0; i < argc; i++) {
+        VALG_ARGDUP(valg_args + i, "%s", argv[i]);
+    }
+
+#undef VALG_ARGS
+#undef VALG_ARGDUP
+
+    return test_argv;
+
+err:
+    test_argv_destroy(test_argv);
+
+    return NULL;
+}
+
+static void
+larmier_opts_destroy(larmier_opts_t *larmier_opts)
+{
+    assert(larmier_opts != NULL);
+
+    test_argv_destroy(larmier_opts->test_argv);
+
+    free(larmier_opts->valgrind);
+    free(larmier_opts->stubsdir);
+    free(larmier_opts->stubslib);
+    free(larmier_opts->tracklib);
+    free(larmier_opts->checkpoint);
+    free(larmier_opts->resume);
+    free(larmier_opts->start);
+    free(larmier_opts->cache);
+    free(larmier_opts->report);
+    free(larmier_opts->trace);
+    free(larmier_opts->batch);
+    free(larmier_opts);
+}
+
+enum {
+    OPT_SHARD = 0x100,
+    OPT_CACHE,
+    OPT_CACHE_SIZE,
+    OPT_REPORT,
+    OPT_TRACE,
+    OPT_PATH_TIMEOUT,
+    OPT_TIMEOUT,
+    OPT_DEDUP,
+    OPT_STREAMS,
+    OPT_BATCH,
+};
+
+static const struct option long_opts[] = {
+    { "help",           no_argument,        NULL, 'h' },
+    { "backend",        required_argument,  NULL, 'b' },
+    { "early-abort",    no_argument,        NULL, 'e' },
+    { "checkpoint",     required_argument,  NULL, 'c' },
+    { "resume",         required_argument,  NULL, 'r' },
+    { "start",          required_argument,  NULL, 's' },
+    { "shard",          required_argument,  NULL, OPT_SHARD },
+    { "cache",          required_argument,  NULL, OPT_CACHE },
+    { "cache-size",     required_argument,  NULL, OPT_CACHE_SIZE },
+    { "report",         required_argument,  NULL, OPT_REPORT },
+    { "trace",          required_argument,  NULL, OPT_TRACE },
+    { "path-timeout",   required_argument,  NULL, OPT_PATH_TIMEOUT },
+    { "timeout",        required_argument,  NULL, OPT_TIMEOUT },
+    { "dedup",          no_argument,        NULL, OPT_DEDUP },
+    { "streams",        required_argument,  NULL, OPT_STREAMS },
+    { "batch",          required_argument,  NULL, OPT_BATCH },
+    { NULL,             0,                  NULL, 0 },
+};
+
+// Parse the options in 'argv', leaving optind at the test (if any).
+static larmier_opts_t *
+larmier_opts_parse(int argc, char **argv)
+{
+    larmier_opts_t *larmier_opts;
+    char *valgrind = NULL;
+    char *stubslib = NULL;
+    char *endptr;
+    double secs;
+    char c;
+    int opt;
+
+    assert(argc > 0);
+    assert(argv != NULL);
+
+    // Allocate a set of opts.
+    larmier_opts = calloc(1, sizeof(*larmier_opts));
+    if (larmier_opts == NULL) {
+        PERR("Error allocating memory for opts: %m");
+        return NULL;
+    }
+    larmier_opts->jobs = 1;
+    larmier_opts->shards = 1;
+    larmier_opts->cache_size = (size_t)CACHE_SIZE << 20;
+
+#define PARSE_OPTS_S(name, desc)                            \
+    do {                                                    \
+        if (name != NULL) {                                 \
+            PERR(desc " already specified (%s)\n", name);   \
+            goto err;                                       \
+        }                                                   \
+        name = strdup(optarg);                              \
+        if (name == NULL) {                                 \
+            PERR("Unable to strdup " desc " (%m)\n");       \
+            goto err;                                       \
+        }                                                   \
+    } while (0)
+
+    // Parse arguments, from scratch if getopt was used before.
+    optind = 0;
+    while ((opt = getopt_long(argc, argv, "hdfxev:l:j:b:c:r:s:", long_opts,
+                              NULL)) != -1) {
+        switch (opt) {
+        case 'b':
+            if (strcmp(optarg, "valgrind") == 0) {
+                larmier_opts->backend = BACKEND_VALGRIND;
+            } else if (strcmp(optarg, "none") == 0) {
+                larmier_opts->backend = BACKEND_NONE;
+            } else if (strcmp(optarg, "sanitizer") == 0) {
+                larmier_opts->backend = BACKEND_SANITIZER;
+            } else if (strcmp(optarg, "track") == 0) {
+                larmier_opts->backend = BACKEND_TRACK;
+            } else {
+                PERR("Invalid backend '%s'\n", optarg);
+                goto err;
+            }
+            break;
+        case 'v':
+            PARSE_OPTS_S(valgrind, "valgrind path");
+            break;
+        case 'd':
+            larmier_opts->debug++;
+            break;
+        case 'f':
+            larmier_opts->forksrv = true;
+            break;
+        case 'x':
+            larmier_opts->explore = true;
+            break;
+        case 'e':
+            larmier_opts->early_abort = true;
+            break;
+        case 'c':
+            PARSE_OPTS_S(larmier_opts->checkpoint, "checkpoint file");
+            break;
+        case 'r':
+            PARSE_OPTS_S(larmier_opts->resume, "checkpoint to resume");
+            break;
+        case 's':
+            PARSE_OPTS_S(larmier_opts->start, "start path");
+            break;
+        case OPT_SHARD:
+            if (sscanf(optarg, "%d/%d%c", &larmier_opts->shard,
+                       &larmier_opts->shards, &c) != 2 ||
+                larmier_opts->shards < 1 || larmier_opts->shard < 0 ||
+                larmier_opts->shard >= larmier_opts->shards) {
+                PERR("Invalid shard '%s' (<i>/<n>, 0 <= i < n)\n", optarg);
+                goto err;
+            }
+            break;
+        case OPT_CACHE:
+            PARSE_OPTS_S(larmier_opts->cache, "cache directory");
+            break;
+        case OPT_CACHE_SIZE:
+            errno = 0;
+            larmier_opts->cache_size = strtoul(optarg, &endptr, 10) << 20;
+            if (*endptr != '\0' || errno != 0 ||
+                larmier_opts->cache_size == 0) {
+                PERR("Invalid cache size '%s' (MiB)\n", optarg);
+                goto err;
+            }
+            break;
+        case OPT_REPORT:
+            PARSE_OPTS_S(larmier_opts->report, "report file");
+            break;
+        case OPT_TRACE:
+            PARSE_OPTS_S(larmier_opts->trace, "trace file");
+            break;
+        case OPT_PATH_TIMEOUT:
+        case OPT_TIMEOUT:
+            secs = strtod(optarg, &endptr);
+            if (*endptr != '\0' || !(secs > 0 && secs < 1e9)) {
+                PERR("Invalid timeout '%s' (seconds)\n", optarg);
+                goto err;
+            }
+            if (opt == OPT_PATH_TIMEOUT) {
+                larmier_opts->path_timeout = secs * 1e9;
+            } else {
+                larmier_opts->timeout = secs * 1e9;
+            }
+            break;
+        case OPT_DEDUP:
+            larmier_opts->dedup = true;
+            break;
+        case OPT_STREAMS:
+            larmier_opts->streams = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || larmier_opts->streams < 1 ||
+                larmier_opts->streams > BCA_STREAMS) {
+                PERR("Invalid number of streams '%s' (1-%d)\n", optarg,
+                     BCA_STREAMS);
+                goto err;
+            }
+            break;
+        case OPT_BATCH:
+            PARSE_OPTS_S(larmier_opts->batch, "batch manifest");
+            break;
+        case 'l':
+            PARSE_OPTS_S(stubslib, "stubs library name");
+            break;
+        case 'j':
+            larmier_opts->jobs = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || larmier_opts->jobs < 1 ||
+                larmier_opts->jobs > JOBS_MAX) {
+                PERR("Invalid number of jobs '%s' (1-%d)\n", optarg, JOBS_MAX);
+                goto err;
+            }
+            break;
+        case 'h':
+        default:
+            help(argv[0]);
+            goto err;
+        }
+    }
+
+#undef PARSE_OPTS_S
+
+    // Forked paths only keep the thread which forked them.
+    if (larmier_opts->explore && larmier_opts->streams > 1) {
+        PERR("Only one of -x and --streams can be specified\n");
+        goto err;
+    }
+
+    // A resumed exploration already knows where to carry on.
+    if (larmier_opts->resume != NULL && larmier_opts->start != NULL) {
+        PERR("Only one of --resume and --start can be specified\n");
+        goto err;
+    }
+
+    // Shards split the tree from its root.
+    if (larmier_opts->start != NULL && larmier_opts->shards > 1) {
+        PERR("Only one of --start and --shard can be specified\n");
+        goto err;
+    }
+
+    // Cached verdicts don't keep the paths which led to them.
+    if (larmier_opts->cache != NULL && larmier_opts->report != NULL) {
+        PERR("Only one of --cache and --report can be specified\n");
+        goto err;
+    }
+
+    // Explorations in a batch run together, and would share these files.
+    if (larmier_opts->batch != NULL &&
+        (larmier_opts->checkpoint != NULL || larmier_opts->resume != NULL ||
+         larmier_opts->cache != NULL || larmier_opts->report != NULL ||
+         larmier_opts->trace != NULL || larmier_opts->shards > 1)) {
+        PERR("--batch can't be used with -c, -r, --shard, --cache, "
+             "--report or --trace\n");
+        goto err;
+    }
+
+    // Ensure we have a valid stubslib and annotate its directory.
+    if (stubslib != NULL) {
+        if (access(stubslib, R_OK) == -1) {
+            PERR("Invalid stubs library at '%s'\n", stubslib);
+            goto err;
+        }
+
+        larmier_opts->stubslib = strdup(stubslib);
+        if (larmier_opts->stubslib == NULL) {
+            PERR("Error duplicating stubslib '%s': %m", stubslib);
+            goto err;
+        }
+
+        larmier_opts->stubsdir = strdup(dirname(stubslib));
+        if (larmier_opts->stubsdir == NULL) {
+            PERR("Error duplicating stubsdir '%s': %m", stubslib);
+            goto err;
+        }
+    }
+
+    // Valgrind is located along with what other backends need, see
+    // larmier_opts_backend().
+    larmier_opts->valgrind = valgrind;
+
+    // Release temporary resources.
+    free(stubslib);
+
+    return larmier_opts;
+
+err:
+    free(valgrind);
+    free(stubslib);
+    free(larmier_opts->stubsdir);
+    free(larmier_opts->stubslib);
+    free(larmier_opts->tracklib);
+    free(larmier_opts->checkpoint);
+    free(larmier_opts->resume);
+    free(larmier_opts->start);
+    free(larmier_opts->cache);
+    free(larmier_opts->report);
+    free(larmier_opts->trace);
+    free(larmier_opts->batch);
+    free(larmier_opts);
+
+    return NULL;
+}
+
+// Locate what the backend needs to run tests with.
+static int
+larmier_opts_backend(larmier_opts_t *larmier_opts)
+{
+    // Ensure we have the leak tracker, if we need it.
+    if (larmier_opts->backend == BACKEND_TRACK) {
+        if (larmier_opts->stubslib == NULL) {
+            PERR("The track backend needs a stubs library\n");
+            return -1;
+        }
+        larmier_opts->tracklib = tracklib_get();
+        if (larmier_opts->tracklib == NULL) {
+            PERR("Unable to locate " TRACKLIB "\n");
+            return -1;
+        }
+    }
+
+    // Ensure we have a valid valgrind, if we need one.
+    if (larmier_opts->backend != BACKEND_VALGRIND) {
+        free(larmier_opts->valgrind);
+        larmier_opts->valgrind = NULL;
+    } else if (larmier_opts->valgrind == NULL) {
+        larmier_opts->valgrind = valgrind_get(NULL);
+        if (larmier_opts->valgrind == NULL) {
+            PERR("Unable to locate valgrind in $PATH\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Set up the test in 'argv' (its program and arguments) to be explored,
+// replacing any explored before.
+static int
+larmier_opts_test(larmier_opts_t *larmier_opts, int argc, char **argv)
+{
+    char **test_argv;
+    int i;
+
+    assert(larmier_opts != NULL);
+
+    // Ensure we have a valid test program.
+    if (argc < 1 || argv == NULL || argv[0] == NULL) {
+        PERR("No test program given\n");
+        return -1;
+    }
+    if (access(argv[0], X_OK) == -1) {
+        PERR("Invalid test program at '%s'\n", argv[0]);
+        return -1;
+    }
+
+    // Create an argv array for valgrind (maybe) and test program.
+    test_argv = test_argv_setup(larmier_opts->valgrind,
+                                larmier_opts->stubslib, argc, argv);
+    if (test_argv == NULL) {
+        return -1;
+    }
+    test_argv_destroy(larmier_opts->test_argv);
+    larmier_opts->test_argv = test_argv;
+
+    // The test comes after valgrind and its options, if any.
+    for (i = 0; test_argv[i] != NULL; i++) {
+        continue;
+    }
+    larmier_opts->test = test_argv[i - argc];
+
+    // Maybe debug test_argv.
+    if (larmier_opts->debug > 0) {
+        test_argv_dump(test_argv);
+    }
+
+    return 0;
+}
+
+static larmier_t *
+larmier_new(int argc, char **argv)
+{
+    larmier_t *larmier;
+
+    larmier = calloc(1, sizeof(*larmier));
+    if (larmier == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+
+    larmier->opts = larmier_opts_parse(argc, argv);
+    if (larmier->opts == NULL) {
+        goto err;
+    }
+
+    larmier->bca_ctxs = calloc(larmier->opts->jobs,
+                               sizeof(*larmier->bca_ctxs));
+    if (larmier->bca_ctxs == NULL) {
+        perror("calloc");
+        goto err;
     }
 
-out:
-    free(spath);
-    return exe;
+    return larmier;
+
+err:
+    larmier_close(larmier);
+    return NULL;
 }
 
-static char *
-valgrind_get(const char *upath)
+larmier_t *
+larmier_open(int argc, char **argv)
 {
-    // Check user-supplied path.
-    if (upath != NULL) {
-        if (access(upath, X_OK) == -1) {
-            return NULL;
-        }
-        return strdup(upath);
+    larmier_t *larmier;
+
+    if (argc < 1 || argv == NULL) {
+        PERR("No arguments given\n");
+        return NULL;
     }
 
-    // Lookup 'valgrind' in system path.
-    return which("valgrind");
+    larmier = larmier_new(argc, argv);
+    if (larmier == NULL) {
+        return NULL;
+    }
+
+    // The test comes with each exploration.
+    if (optind < argc) {
+        PERR("Unexpected argument '%s'\n", argv[optind]);
+        larmier_close(larmier);
+        return NULL;
+    }
+    if (larmier->opts->batch != NULL) {
+        PERR("--batch is only for the command line\n");
+        larmier_close(larmier);
+        return NULL;
+    }
+    if (larmier_opts_backend(larmier->opts) == -1) {
+        larmier_close(larmier);
+        return NULL;
+    }
+
+    return larmier;
 }
 
-static void
-help (char *argv0)
+int
+larmier_run(larmier_t *larmier, int argc, char **argv,
+            larmier_result_cb_t cb, void *data)
 {
-    assert(argv0 != NULL);
+    assert(larmier != NULL);
 
-    PERR("LARMIER %s\n", VERSION);
-    PERR("Usage: %s [ opts ] < cmd [ args ... ] >\n", argv0);
-    PERR("   Valid opts:\n");
-    PERR("       -h              Display this help and exit\n");
-    PERR("       -d[d...]        Increase debug level\n");
-    PERR("       -v <valgrind>   Path to valgrind (default: search $PATH)\n");
-    PERR("       -l <stubs_lib>  Name of stubs shared library\n");
+    if (larmier_opts_test(larmier->opts, argc, argv) == -1) {
+        return -1;
+    }
+
+    return explore(larmier->opts, larmier->bca_ctxs, cb, data);
 }
 
-static void
-valgrind_argv_dump(char **valgrind_argv) {
-    char **tmp;
+void
+larmier_close(larmier_t *larmier)
+{
+    int i;
 
-    if (valgrind_argv == NULL) {
+    if (larmier == NULL) {
         return;
     }
 
-    for (tmp = valgrind_argv; *tmp != NULL; tmp++) {
-        POUT("'%s'", *tmp);
-        if (*(tmp+1) != NULL) {
-            POUT(" ");
+    if (larmier->bca_ctxs != NULL) {
+        for (i = 0; i < larmier->opts->jobs; i++) {
+            if (larmier->bca_ctxs[i] != NULL) {
+                bca_ctx_destroy(larmier->bca_ctxs[i]);
+            }
         }
+        free(larmier->bca_ctxs);
     }
-    POUT("\n");
+    if (larmier->opts != NULL) {
+        larmier_opts_destroy(larmier->opts);
+    }
+    free(larmier);
 }
 
+#ifndef LARMIER_LIB
 static void
-valgrind_argv_destroy(char **valgrind_argv) {
-    char **tmp;
-
-    if (valgrind_argv == NULL) {
-        return;
-    }
+batch_destroy(batch_entry_t *entries, size_t nentries)
+{
+    size_t i;
 
-    for (tmp = valgrind_argv; *tmp != NULL; tmp++) {
-        free(*tmp);
+    for (i = 0; i < nentries; i++) {
+        if (entries[i].ctx != NULL) {
+            larmier_ctx_destroy(entries[i].ctx, entries[i].larmier->opts);
+        }
+        larmier_close(entries[i].larmier);
     }
-
-    free(valgrind_argv);
+    free(entries);
 }
 
-static char **
-valgrind_argv_setup(const char *valgrind, const char *stubslib,
-                    int argc, char **argv)
+// Read the tests of a --batch from 'manifest', one per line: larmier options
+// (on top of those in 'argv') and the test with its arguments, separated by
+// whitespace. Blank lines and lines starting with '#' are skipped.
+static batch_entry_t *
+batch_read(const char *manifest, int argc, char **argv, size_t *nentries)
 {
-    char **valgrind_argv;
-    int valg_args;
-    int i;
+    larmier_opts_t *larmier_opts;
+    batch_entry_t *entries = NULL;
+    batch_entry_t *tmp;
+    unsigned int line_no = 0;
+    char **entry_argv = NULL;
+    int entry_argc;
+    char *line = NULL;
+    size_t len = 0;
+    size_t n = 0;
+    FILE *stream;
+    char *tok;
+
+    stream = fopen(manifest, "re");
+    if (stream == NULL) {
+        PERR("Unable to open '%s': %m\n", manifest);
+        return NULL;
+    }
 
-    assert(valgrind != NULL);
-    assert(argc > 0);
-    assert(argv != NULL);
+    while (getline(&line, &len, stream) != -1) {
+        line_no++;
 
-#define VALG_ARGDUP(i, ...)                             \
-    do {                                                \
-        int err;                                        \
-        err = asprintf(&valgrind_argv[i], __VA_ARGS__); \
-        if (err == -1) {                                \
-            perror("asprintf");                         \
-            valgrind_argv[i] = NULL;                    \
-            goto err;                                   \
-        }                                               \
-    } while (0)
+        // Options given to larmier come first, then those of the line.
+        free(entry_argv);
+        entry_argv = calloc(argc + strlen(line) / 2 + 2, sizeof(char *));
+        if (entry_argv == NULL) {
+            perror("calloc");
+            goto err;
+        }
+        (void)memcpy(entry_argv, argv, argc * sizeof(char *));
+        entry_argc = argc;
+        for (tok = strtok(line, " \t\n"); tok != NULL;
+             tok = strtok(NULL, " \t\n")) {
+            if (entry_argc == argc && tok[0] == '#') {
+                break;
+            }
+            entry_argv[entry_argc++] = tok;
+        }
+        if (entry_argc == argc) {
+            continue;
+        }
 
-#define VALG_ARGS 9
-    // Determine exact number of valgrind args.
-    valg_args = VALG_ARGS;
-    if (stubslib == NULL) {
-        valg_args--;
-    }
+        tmp = realloc(entries, (n + 1) * sizeof(*entries));
+        if (tmp == NULL) {
+            perror("realloc");
+            goto err;
+        }
+        entries = tmp;
+        (void)memset(&entries[n], 0, sizeof(entries[n]));
+        entries[n].line = line_no;
 
-    // Allocate new argv array for valgrind.
-    valgrind_argv = calloc(1, sizeof(char *) * (valg_args + argc + 1));
-    if (valgrind_argv == NULL) {
-        perror("calloc");
-        return NULL;
+        entries[n].larmier = larmier_new(entry_argc, entry_argv);
+        if (entries[n].larmier == NULL) {
+            PERR("%s:%u: Invalid entry\n", manifest, line_no);
+            goto err;
+        }
+        n++;
+        if (optind >= entry_argc) {
+            PERR("%s:%u: No test given\n", manifest, line_no);
+            goto err;
+        }
+        larmier_opts = entries[n - 1].larmier->opts;
+        if (larmier_opts_backend(larmier_opts) == -1 ||
+            larmier_opts_test(larmier_opts, entry_argc - optind,
+                              &entry_argv[optind]) == -1) {
+            PERR("%s:%u: Invalid entry\n", manifest, line_no);
+            goto err;
+        }
     }
-
-    // Fill in argv array with valgrind-related entries.
-    VALG_ARGDUP(0, "%s", valgrind);
-    VALG_ARGDUP(1, "--track-fds=yes");
-    VALG_ARGDUP(2, "--leak-check=full");
-    VALG_ARGDUP(3, "--show-leak-kinds=all");
-    VALG_ARGDUP(4, "--error-exitcode=%d", EXIT_ERR_VALGRIND);
-    VALG_ARGDUP(5, "--suppressions=dlsym.supp");
-    VALG_ARGDUP(6, "--track-origins=yes");
-    VALG_ARGDUP(7, "--fair-sched=yes");
-    if (stubslib != NULL) {
-        VALG_ARGDUP(8, "--soname-synonyms=somalloc=%s", stubslib);
+    if (ferror(stream)) {
+        PERR("Unable to read '%s'\n", manifest);
+        goto err;
     }
-
-    // Fill in argv array with test-related entries.
-    for (i = 0; i < argc; i++) {
-        VALG_ARGDUP(valg_args + i, "%s", argv[i]);
+    if (n == 0) {
+        PERR("No tests in '%s'\n", manifest);
+        goto err;
     }
 
-#undef VALG_ARGS
-#undef VALG_ARGDUP
+    free(entry_argv);
+    free(line);
+    (void)fclose(stream);
 
-    return valgrind_argv;
+    *nentries = n;
+    return entries;
 
 err:
-    valgrind_argv_destroy(valgrind_argv);
+    batch_destroy(entries, n);
+    free(entry_argv);
+    free(line);
+    (void)fclose(stream);
 
     return NULL;
 }
 
+// Report the verdict of a test in a batch, and release its workers.
 static void
-larmier_opts_destroy(larmier_opts_t *larmier_opts)
+batch_done(batch_entry_t *entry, const char *manifest, int err)
 {
-    assert(larmier_opts != NULL);
-
-    valgrind_argv_destroy(larmier_opts->valgrind_argv);
-
-    free(larmier_opts->stubsdir);
-    free(larmier_opts->stubslib);
-    free(larmier_opts);
+    larmier_opts_t *larmier_opts = entry->larmier->opts;
+    larmier_ctx_t *larmier_ctx = entry->ctx;
+
+    entry->err = explore_verdict(larmier_ctx, err);
+    explore_dump(larmier_ctx, larmier_opts, entry->err);
+    POUT("%s:%u: %s: exit status 0x%X (%s)\n", manifest, entry->line,
+         larmier_opts->test, entry->err, exit_class(entry->err));
+
+    // Anything still running is killed, and leaves the shared pool.
+    *larmier_ctx->slots += larmier_ctx->busy;
+    larmier_ctx_destroy(larmier_ctx, larmier_opts);
+    entry->ctx = NULL;
 }
 
-static larmier_opts_t *
-larmier_opts_parse(int argc, char **argv)
+// Explore every test in the --batch manifest at once. Paths of all tests
+// share a pool of as many workers as -j, which are handed out in the order
+// of the manifest. Returns whether any of them failed (as larmier would).
+static int
+larmier_batch(larmier_t *larmier, int argc, char **argv)
 {
+    const char *manifest = larmier->opts->batch;
+    struct pollfd *pfds = NULL;
     larmier_opts_t *larmier_opts;
-    char *valgrind = NULL;
-    char *stubslib = NULL;
-    int opt;
-
-    assert(argc > 0);
-    assert(argv != NULL);
+    larmier_ctx_t *larmier_ctx;
+    batch_entry_t *entries;
+    batch_entry_t *entry;
+    sighandler_t sigpipe;
+    int slots = larmier->opts->jobs;
+    int timeout, t;
+    size_t nentries, running, i;
+    nfds_t nfds;
+    int ret = -1;
+    int err;
 
-    // Allocate a set of opts.
-    larmier_opts = calloc(1, sizeof(*larmier_opts));
-    if (larmier_opts == NULL) {
-        PERR("Error allocating memory for opts: %m");
-        return NULL;
+    entries = batch_read(manifest, argc, argv, &nentries);
+    if (entries == NULL) {
+        return -1;
     }
 
-#define PARSE_OPTS_S(name, desc)                            \
-    do {                                                    \
-        if (name != NULL) {                                 \
-            PERR(desc " already specified (%s)\n", name);   \
-            goto err;                                       \
-        }                                                   \
-        name = strdup(optarg);                              \
-        if (name == NULL) {                                 \
-            PERR("Unable to strdup " desc " (%m)\n");       \
-            goto err;                                       \
-        }                                                   \
-    } while (0)
-
-    // Parse arguments.
-    while ((opt = getopt(argc, argv, "hdv:l:")) != -1) {
-        switch (opt) {
-        case 'v':
-            PARSE_OPTS_S(valgrind, "valgrind path");
-            break;
-        case 'd':
-            larmier_opts->debug++;
-            break;
-        case 'l':
-            PARSE_OPTS_S(stubslib, "stubs library name");
-            break;
-        case 'h':
-        default:
-            help(argv[0]);
-            goto err;
+    // Don't die writing to a fork server which went away.
+    sigpipe = signal(SIGPIPE, SIG_IGN);
+    larmier_stop = 0;
+
+    // Every test gets its own workers, but only so many run at once.
+    nfds = 0;
+    for (i = 0; i < nentries; i++) {
+        entry = &entries[i];
+        larmier_opts = entry->larmier->opts;
+        entry->ctx = larmier_ctx_create(larmier_opts,
+                                        entry->larmier->bca_ctxs, NULL);
+        if (entry->ctx == NULL) {
+            goto out;
         }
+        entry->ctx->slots = &slots;
+        if (explore_setup(entry->ctx, larmier_opts) == -1) {
+            goto out;
+        }
+        nfds += 3 * entry->ctx->nworkers;
     }
-
-#undef PARSE_OPTS_S
-
-    // Ensure we have a valid test program.
-    if (argc <= optind) {
-        help(argv[0]);
-        goto err;
-    }
-    if (access(argv[optind], X_OK) == -1) {
-        PERR("Invalid test program at '%s'\n", argv[optind]);
-        goto err;
+    pfds = calloc(nfds, sizeof(*pfds));
+    if (pfds == NULL) {
+        perror("calloc");
+        goto out;
     }
 
-    // Ensure we have a valid stubslib and annotate its directory.
-    if (stubslib != NULL) {
-        if (access(stubslib, R_OK) == -1) {
-            PERR("Invalid stubs library at '%s'\n", stubslib);
-            goto err;
+    running = nentries;
+    while (running > 0 && !larmier_stop) {
+        // Hand out paths, tests earlier in the manifest first.
+        for (i = 0; i < nentries; i++) {
+            entry = &entries[i];
+            entry->pfds = NULL;
+            if (entry->ctx == NULL) {
+                continue;
+            }
+            err = loop_spawn(entry->ctx, entry->larmier->opts);
+            if (err != 0) {
+                batch_done(entry, manifest, err);
+                running--;
+            }
         }
-
-        larmier_opts->stubslib = strdup(stubslib);
-        if (larmier_opts->stubslib == NULL) {
-            PERR("Error duplicating stubslib '%s': %m", stubslib);
-            goto err;
+        if (running == 0) {
+            break;
         }
 
-        larmier_opts->stubsdir = strdup(dirname(stubslib));
-        if (larmier_opts->stubsdir == NULL) {
-            PERR("Error duplicating stubsdir '%s': %m", stubslib);
-            goto err;
+        // Wait for any of them, or for the first path to time out.
+        nfds = 0;
+        timeout = -1;
+        for (i = 0; i < nentries; i++) {
+            entry = &entries[i];
+            if (entry->ctx == NULL) {
+                continue;
+            }
+            entry->pfds = &pfds[nfds];
+            loop_pollfds(entry->ctx, entry->pfds);
+            nfds += 3 * entry->ctx->nworkers;
+            t = loop_timeout(entry->ctx, entry->larmier->opts);
+            if (t != -1 && (timeout == -1 || t < timeout)) {
+                timeout = t;
+            }
+        }
+        err = poll(pfds, nfds, timeout);
+        if (err == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
         }
-    }
 
-    // Ensure we have a valid valgrind.
-    if (valgrind == NULL) {
-        valgrind = valgrind_get(NULL);
-        if (valgrind == NULL) {
-            PERR("Unable to locate valgrind in $PATH\n");
-            goto err;
+        // Out of time, stop every test as if asked to. They all started
+        // together.
+        for (i = 0; i < nentries; i++) {
+            larmier_ctx = entries[i].ctx;
+            if (larmier_ctx != NULL && larmier_ctx->deadline != 0 &&
+                now_ns() >= larmier_ctx->deadline) {
+                larmier_stop = 1;
+            }
+        }
+        if (larmier_stop) {
+            for (i = 0; i < nentries; i++) {
+                if (entries[i].ctx != NULL) {
+                    entries[i].ctx->expired = true;
+                }
+            }
+            break;
         }
-    }
 
-    // Create an argv array for valgrind and test program.
-    larmier_opts->valgrind_argv = valgrind_argv_setup(valgrind,
-                                                      larmier_opts->stubslib,
-                                                      argc-optind,
-                                                      &argv[optind]);
-    if (larmier_opts->valgrind_argv == NULL) {
-        goto err;
+        // Collect output and finished paths.
+        for (i = 0; i < nentries; i++) {
+            entry = &entries[i];
+            if (entry->pfds == NULL) {
+                continue;
+            }
+            err = loop_collect(entry->ctx, entry->pfds, entry->larmier->opts);
+            if (err != 0) {
+                batch_done(entry, manifest, err);
+                running--;
+            }
+        }
     }
 
-    // Maybe debug valgrind_argv.
-    if (larmier_opts->debug > 0) {
-        valgrind_argv_dump(larmier_opts->valgrind_argv);
+    // Tests left over were stopped (or larmier failed).
+    ret = 0;
+    for (i = 0; i < nentries; i++) {
+        entry = &entries[i];
+        if (entry->ctx != NULL) {
+            batch_done(entry, manifest, EXIT_MASK_SYSTEM | EXIT_ERR_LARMIER);
+        }
+        if ((entry->err & ~EXIT_MASK) != 0) {
+            ret = 1;
+        }
     }
 
-    // Release temporary resources.
-    free(valgrind);
-    free(stubslib);
-
-    return larmier_opts;
-
-err:
-    free(valgrind);
-    free(stubslib);
-    free(larmier_opts->stubsdir);
-    free(larmier_opts->stubslib);
-    free(larmier_opts);
+out:
+    (void)signal(SIGPIPE, sigpipe);
+    free(pfds);
+    batch_destroy(entries, nentries);
 
-    return NULL;
+    return ret;
 }
 
 int
 main(int argc, char **argv)
 {
-    larmier_opts_t *larmier_opts;
+    larmier_t *larmier;
     int ret = EXIT_SUCCESS;
 
-    // Parse arguments.
-    larmier_opts = larmier_opts_parse(argc, argv);
-    if (larmier_opts == NULL) {
+    // Combine the results of a sharded exploration.
+    if (argc > 1 && strcmp(argv[1], "merge") == 0) {
+        if (argc < 3) {
+            help(argv[0]);
+            return EXIT_FAILURE;
+        }
+        return (larmier_merge(argc - 2, &argv[2]) != 0) ? EXIT_FAILURE :
+                                                          EXIT_SUCCESS;
+    }
+
+    // Parse arguments, up to the test.
+    larmier = larmier_new(argc, argv);
+    if (larmier == NULL) {
         return EXIT_FAILURE;
     }
 
-    // Run tests under valgrind.
-    if (larmier(larmier_opts) != 0) {
+    // Maybe run every test listed in a manifest instead.
+    if (larmier->opts->batch != NULL) {
+        if (optind < argc) {
+            PERR("Unexpected argument '%s'\n", argv[optind]);
+            goto err;
+        }
+        if (larmier_batch(larmier, argc, argv) != 0) {
+            goto err;
+        }
+        goto out;
+    }
+
+    if (argc <= optind) {
+        help(argv[0]);
+        goto err;
+    }
+    if (larmier_opts_backend(larmier->opts) == -1) {
+        goto err;
+    }
+
+    // Run tests (under valgrind, by default).
+    if ((larmier_run(larmier, argc - optind, &argv[optind], NULL, NULL) &
+         ~EXIT_MASK) != 0) {
         goto err;
     }
 
 out:
-    larmier_opts_destroy(larmier_opts);
+    larmier_close(larmier);
 
     return ret;
 
@@ -790,3 +4408,5 @@ err:
     ret = EXIT_FAILURE;
     goto out;
 }
+
+#endif /* LARMIER_LIB */
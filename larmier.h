@@ -21,19 +21,56 @@
 #define LARMIER_H
 
 #define LARMIER_BCA     "LARMIER_BCA"
-#define LARMIER_LEN     4096
-#define BCA_MAP_LEN     (LARMIER_LEN - sizeof(uint16_t))
+#define LARMIER_LEN     4096    // Initial bca size, grown on demand
+
+#define BCA_BITS        4       // Bits per call in the bca map
+#define BCA_MASK        ((1 << BCA_BITS) - 1)
+#define BCA_REAL        BCA_MASK                // Don't inject, call for real
+#define BCA_LAST        (1 << (BCA_BITS - 1))   // Set on a stub's last outcome
+#define BCA_OUTCOMES    (BCA_LAST - 1)          // Max error outcomes per stub
+#define BCA_UNUSED      BCA_OUTCOMES            // Not a call, see streams
+#define BCA_OUTCOME(v)  (((v) == BCA_REAL) ? BCA_REAL : ((v) & ~BCA_LAST))
+#define BCA_BYTES(n)    (((uint64_t)(n) * BCA_BITS + 7) / 8)
+#define BCA_CAPACITY(s) (((uint64_t)(s) - sizeof(bca_t)) * 8 / BCA_BITS)
+#define BCA_RING        8       // Backtraces kept of the latest injections
+#define BCA_FRAMES      8       // Return addresses kept per backtrace
+#define BCA_STREAMS     64      // Max streams of calls, one per thread
+
+#define LARMIER_FORKSRV "LARMIER_FORKSRV"
+#define LARMIER_EXPLORE "LARMIER_EXPLORE"
+#define LARMIER_DEDUP   "LARMIER_DEDUP"
+#define LARMIER_CTL_FD  198     // Test reads path requests and acks from here
+#define LARMIER_ST_FD   199     // Test writes path statuses to here
+
+#define LARMIER_ST_LEAF 0x1     // Path was forked off at an injection site
+
+#define LARMIER_EXIT_ERR 0xFD   // Larmier (or its stubs runtime) failed
 
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <sys/resource.h>
 
 void
 larmier_stub(bool on);
 
+// Provided by the stubs runtime (larmier_stub.h) when it is preloaded.
+void
+larmier_stub_hook(bool on) __attribute__((weak));
+
+// Provided by the leak tracker (larmier_track.c) when it is preloaded.
+void
+larmier_track_hook(bool on) __attribute__((weak));
+
 void
 larmier_stub(bool on)
 {
+    // Tell the stubs runtime directly if it is there.
+    if (larmier_stub_hook != NULL) {
+        larmier_stub_hook(on);
+        return;
+    }
+
     if (on) {
         setenv("LARMIER_STUB", "1", 1);
     } else {
@@ -41,9 +78,74 @@ larmier_stub(bool on)
     }
 }
 
+// Where a failure was injected, as raw return addresses. The first one is the
+// stubbed call itself, further ones are only there if the test keeps frame
+// pointers. Larmier looks them up in the test when reporting a failed path.
+typedef struct {
+    uint64_t base;              // Load address of the test program
+    uint64_t frames[BCA_FRAMES];
+    uint32_t seq;               // Injection it was taken at, from 1
+    uint32_t slot;              // Call it was taken at
+    uint32_t nframes;
+} bca_trace_t;
+
+// Shared by larmier and every thread of the test. The stubs runtime updates
+// it atomically, so fields are kept aligned rather than packed.
+typedef struct {
+    uint32_t size;              // Bytes backing the bca, grown on demand
+    uint32_t count;
+    uint32_t prefix;            // Calls beyond this are forked when exploring
+    uint32_t dirty;             // Calls beyond this are zero in the map
+    uint32_t heap_leaks;        // Reported by the leak tracker at exit
+    uint32_t fd_leaks;
+    uint32_t pruned;            // Calls made for real by dedup, see --dedup
+    uint32_t traces;            // Backtraces taken, ring[] holds the latest
+    bca_trace_t ring[BCA_RING];
+
+    // With more than one stream, each thread (in creation order, up to the
+    // last stream) makes its calls on its own stream, so how threads are
+    // scheduled doesn't change which call is which. Call 'n' of stream 's'
+    // is at 'n * streams + s' in the map, and calls no stream got to are
+    // left as BCA_UNUSED by larmier.
+    uint32_t streams;
+    uint32_t calls[BCA_STREAMS];        // Made on each stream so far
+
+    // With shards, a test exploring by forking only forks at calls which
+    // are its shard's (see --shard) until it fails one.
+    uint32_t shard;
+    uint32_t shards;
+
+    uint8_t map[];              // BCA_BITS per call, an outcome or BCA_REAL
+} bca_t;
+
+// Whether a call in the map had a failure injected.
+static inline bool
+bca_failed(unsigned int val)
+{
+    return val != BCA_REAL && val != BCA_UNUSED;
+}
+
+static inline unsigned int
+bca_get(const uint8_t *map, uint32_t i)
+{
+    uint64_t bit = (uint64_t)i * BCA_BITS;
+
+    return (map[bit / 8] >> (bit % 8)) & BCA_MASK;
+}
+
+static inline void
+bca_set(uint8_t *map, uint32_t i, unsigned int val)
+{
+    uint64_t bit = (uint64_t)i * BCA_BITS;
+
+    map[bit / 8] &= ~(BCA_MASK << (bit % 8));
+    map[bit / 8] |= (val & BCA_MASK) << (bit % 8);
+}
+
 typedef struct {
-    uint16_t count;
-    char map[BCA_MAP_LEN];
-} __attribute__((packed)) bca_t;
+    int status;                 // As returned by wait4()
+    int flags;
+    struct rusage rusage;       // Of the path, and of any paths it forked
+} larmier_st_t;
 
 #endif /* LARMIER_H */
@@ -28,123 +28,148 @@
 #define __USE_GNU
 #endif
 
-#ifndef UNW_LOCAL_ONLY
-#define UNW_LOCAL_ONLY
-#endif
-
 #include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <libunwind.h>
+#include <limits.h>
+#include <link.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "larmier.h"
 
-#ifdef LARMIER_DEBUG
+// Per thread, as threads make (and stub) calls concurrently.
+static __thread bool stub_off __attribute__((unused)) = false;
+static __thread bool in_dlsym __attribute__((unused)) = false;
 
-#include <stdio.h>
+// Which of its outcomes a stub body (see LSDEFo) should produce.
+static __thread unsigned int larmier_outcome __attribute__((unused));
 
-static void
-print_trace(void)
-{
-    unw_context_t ctx;
-    unw_cursor_t cur;
-    unw_word_t ip;
-    Dl_info di;
+#define LARMIER_RANGES_MAX 16
 
-    unw_getcontext(&ctx);
-    unw_init_local(&cur, &ctx);
+// Executable segments of the main program, whose calls are the ones stubbed.
+// The main program is never unloaded or moved, so these are computed once.
+static struct {
+    uintptr_t start;
+    uintptr_t end;
+} larmier_ranges[LARMIER_RANGES_MAX];
+static int larmier_nranges = -1;
+static uintptr_t larmier_base;
 
-    do {
-        unw_get_reg(&cur, UNW_REG_IP, &ip);
-        dladdr((void *)ip, &di);
-        printf("ip = %lx (%s) (%s)\n", (long)ip, di.dli_fname, di.dli_sname);
-    } while (unw_step(&cur) > 0);
-}
+static int
+larmier_ranges_cb(struct dl_phdr_info *info, size_t size, void *data)
+{
+    const ElfW(Phdr) *phdr;
+    int *nranges = data;
+    int i;
+
+    // The main program is always reported first.
+    *nranges = 0;
+    larmier_base = info->dlpi_addr;
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X) ||
+            *nranges == LARMIER_RANGES_MAX) {
+            continue;
+        }
+        larmier_ranges[*nranges].start = info->dlpi_addr + phdr->p_vaddr;
+        larmier_ranges[*nranges].end = larmier_ranges[*nranges].start +
+                                       phdr->p_memsz;
+        (*nranges)++;
+    }
 
-#else
+    return 1;
+}
 
-static void
-print_trace(void) { }
+static inline bool
+larmier_in_main(uintptr_t addr, int nranges)
+{
+    int i;
 
-#endif /* LARMIER_DEBUG */
+    for (i = 0; i < nranges; i++) {
+        if (addr >= larmier_ranges[i].start && addr < larmier_ranges[i].end) {
+            return true;
+        }
+    }
 
-static bool stub_off __attribute__((unused)) = false;
-static bool in_dlsym __attribute__((unused)) = false;
+    return false;
+}
 
-#define PROG_NAME_MAX 256
+// Whether to stub, as last set by larmier_stub(). Tests built against an
+// older larmier.h only set LARMIER_STUB in the environment, so that is used
+// until larmier_stub_hook() is first called.
+#define LARMIER_STUB_ENV (-1)
+static int larmier_stub_on = LARMIER_STUB_ENV;
 
 static bool
-dont_stub(void)
+dont_stub(void *caller)
 {
-    static char exe[PROG_NAME_MAX + 1];
-    unw_context_t ctx;
-    unw_cursor_t cur;
-    unw_word_t ip;
-    Dl_info di;
+    int nranges = __atomic_load_n(&larmier_nranges, __ATOMIC_ACQUIRE);
+    int on = __atomic_load_n(&larmier_stub_on, __ATOMIC_RELAXED);
     const char *ptr;
-    char *ptr2;
 
-    // If LARMIER_STUB is not set or set to zero, don't stub.
-    ptr = getenv("LARMIER_STUB");
-    if (ptr == NULL || strcmp(ptr, "0") == 0) {
-        return true;
+    if (on == LARMIER_STUB_ENV) {
+        ptr = getenv("LARMIER_STUB");
+        on = (ptr != NULL && strcmp(ptr, "0") != 0);
     }
 
-    // Initialise libunwind context and cursor.
-    unw_getcontext(&ctx);
-    unw_init_local(&cur, &ctx);
-
-    // Figure out the name of this executable.
-    if (exe[0] == '\0') {
-        // The below is probably better than keeping a copy of cur.
-        while (unw_step(&cur)) {
-            unw_get_reg(&cur, UNW_REG_IP, &ip);
-            dladdr((void *)ip, &di);
-        }
-
-        // strcpy(exe, di.dli_fname);
-        ptr = di.dli_fname;
-        ptr2 = exe;
-        do {
-            *ptr2++ = *ptr++;
-        } while (*ptr != '\0' && (ptr2 - exe < PROG_NAME_MAX));
+    // If stubbing is off, don't stub.
+    if (!on) {
+        return true;
+    }
 
-        // This block moved up the cursor, so reset it.
-        unw_init_local(&cur, &ctx);
+    // Locate the main program on first use.
+    if (nranges < 0) {
+        (void)dl_iterate_phdr(larmier_ranges_cb, &nranges);
+        __atomic_store_n(&larmier_nranges, nranges, __ATOMIC_RELEASE);
     }
 
-    // Determine whether we're coming from another library.
-    unw_step(&cur); // skip current stack
-    unw_step(&cur); // skip stub stack
-    unw_get_reg(&cur, UNW_REG_IP, &ip);
-    dladdr((void *)ip, &di);
+    // Only stub calls coming from the main program (not other libraries).
+    return !larmier_in_main((uintptr_t)caller, nranges);
+}
 
-    // strcmp(exe, di.dli_fname);
-    ptr = di.dli_fname;
-    ptr2 = exe;
-    while (*ptr != '\0' && *ptr2 != '\0' && *ptr == *ptr2) {
-        ptr++;
-        ptr2++;
-    }
-    if (*ptr == '\0' && *ptr2 == '\0') {
-        // We came from the main prog, so stub.
-        return false;
-    }
+// The bca is attached on first use and stays mapped for the lifetime of the
+// process. The mapping is shared, so it survives fork() and children (eg. of
+// the fork server or when exploring) keep updating the same bca. Processes
+// exec()ed by the test start afresh and attach again on their first call.
+static bca_t *larmier_bca = NULL;
+static size_t larmier_bca_len = 0;
+static char larmier_bca_name[NAME_MAX];
+static bool larmier_exploring = false;
+static bool larmier_dedup = false;
+static bool larmier_failed = false;     // Whether any call was failed yet
+
+// Spin locks for attaching to and growing the bca. A thread may hold either
+// while another forks, leaving the child with a lock nobody will release.
+static bool larmier_attaching = false;
+static bool larmier_growing = false;
 
-    return true;
+static void
+larmier_atfork_child(void)
+{
+    __atomic_clear(&larmier_attaching, __ATOMIC_RELAXED);
+    __atomic_clear(&larmier_growing, __ATOMIC_RELAXED);
 }
 
-static inline void *
-larmier_get_bca(void)
+static void __attribute__((constructor))
+larmier_atfork(void)
+{
+    (void)pthread_atfork(NULL, NULL, larmier_atfork_child);
+}
+
+static void *
+larmier_attach_bca(void)
 {
     char *bca_name = getenv(LARMIER_BCA);
     bca_t *bca = MAP_FAILED;
+    struct stat st;
     int bca_fd;
 
     if (bca_name != NULL) {
@@ -153,25 +178,550 @@ larmier_get_bca(void)
             goto out;
         }
 
-        bca = mmap(NULL, LARMIER_LEN, PROT_READ | PROT_WRITE,
-                   MAP_SHARED, bca_fd, 0);
+        // Larmier may have grown the bca already.
+        if (fstat(bca_fd, &st) == 0 && (size_t)st.st_size >= LARMIER_LEN) {
+            bca = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, bca_fd, 0);
+        }
         (void)close(bca_fd);
+        if (bca != MAP_FAILED) {
+            larmier_bca_len = st.st_size;
+            (void)snprintf(larmier_bca_name, sizeof(larmier_bca_name), "%s",
+                           bca_name);
+        }
+    }
+
+    larmier_exploring = (getenv(LARMIER_EXPLORE) != NULL);
+    larmier_dedup = (getenv(LARMIER_DEDUP) != NULL);
+
+out:
+    return bca;
+}
+
+static inline void *
+larmier_get_bca(void)
+{
+    bca_t *bca = __atomic_load_n(&larmier_bca, __ATOMIC_ACQUIRE);
+
+    if (bca != NULL) {
+        return bca;
+    }
+
+    // Only one thread attaches, so the mapping and its length agree.
+    while (__atomic_test_and_set(&larmier_attaching, __ATOMIC_ACQUIRE)) {
+        ;
+    }
+    bca = __atomic_load_n(&larmier_bca, __ATOMIC_ACQUIRE);
+    if (bca == NULL) {
+        bca = larmier_attach_bca();
+        __atomic_store_n(&larmier_bca, bca, __ATOMIC_RELEASE);
+    }
+    __atomic_clear(&larmier_attaching, __ATOMIC_RELEASE);
+
+    return bca;
+}
+
+// The bca holds LARMIER_LEN bytes to start with. A call beyond what is
+// mapped either catches up with a bca grown elsewhere (by a forked child or
+// by larmier) or doubles it. Growing can't be reported back to the test, so
+// failing to do so aborts with LARMIER_EXIT_ERR.
+static bca_t *
+larmier_grow_bca(uint32_t slot)
+{
+    bca_t *bca;
+    size_t size;
+    void *new_bca;
+    int bca_fd;
+
+    // Only one thread grows the bca, others wait and use its mapping.
+    while (__atomic_test_and_set(&larmier_growing, __ATOMIC_ACQUIRE)) {
+        ;
+    }
+    bca = __atomic_load_n(&larmier_bca, __ATOMIC_ACQUIRE);
+    if (slot < BCA_CAPACITY(larmier_bca_len)) {
+        goto out;
     }
 
+    size = bca->size;
+    bca_fd = shm_open(larmier_bca_name, O_RDWR, 0600);
+    if (bca_fd < 0) {
+        _exit(LARMIER_EXIT_ERR);
+    }
+    if (slot >= BCA_CAPACITY(size)) {
+        while (slot >= BCA_CAPACITY(size)) {
+            size *= 2;
+        }
+        if (size > UINT32_MAX || ftruncate(bca_fd, size) != 0) {
+            _exit(LARMIER_EXIT_ERR);
+        }
+    }
+
+    // Grow in place if possible. Otherwise, map it anew and keep the old
+    // mapping, as other threads may still be using it.
+    new_bca = mremap(bca, larmier_bca_len, size, 0);
+    if (new_bca == MAP_FAILED) {
+        new_bca = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       bca_fd, 0);
+        if (new_bca == MAP_FAILED) {
+            _exit(LARMIER_EXIT_ERR);
+        }
+    }
+    (void)close(bca_fd);
+    bca = new_bca;
+    bca->size = size;
+
+    // The mapping is published ahead of its length, see larmier_bca_for().
+    __atomic_store_n(&larmier_bca, bca, __ATOMIC_RELEASE);
+    __atomic_store_n(&larmier_bca_len, size, __ATOMIC_RELEASE);
+
 out:
+    __atomic_clear(&larmier_growing, __ATOMIC_RELEASE);
+
     return bca;
 }
 
+// Returns a mapping of the bca which holds 'slot'. Once the length mapped is
+// large enough, the mapping loaded after it is too.
+static inline bca_t *
+larmier_bca_for(uint32_t slot)
+{
+    if (slot >= BCA_CAPACITY(__atomic_load_n(&larmier_bca_len,
+                                             __ATOMIC_ACQUIRE))) {
+        return larmier_grow_bca(slot);
+    }
+
+    return __atomic_load_n(&larmier_bca, __ATOMIC_ACQUIRE);
+}
+
+// Real functions are looked up once per symbol and cached in 'cache'.
+// Racing threads resolve to the same function, so either store wins.
+static void *
+larmier_real(void **cache, const char *lib, const char *name)
+{
+    void *func = __atomic_load_n(cache, __ATOMIC_ACQUIRE);
+    void *libp;
+
+    if (func != NULL) {
+        return func;
+    }
+
+    if (lib == NULL) {
+        func = dlsym(RTLD_NEXT, name);
+    } else {
+        // The library stays open, as its functions are kept around.
+        libp = dlopen(lib, RTLD_GLOBAL | RTLD_LAZY);
+        func = dlsym(libp, name);
+    }
+    __atomic_store_n(cache, func, __ATOMIC_RELEASE);
+
+    return func;
+}
+
+static void
+larmier_forksrv(void)
+{
+    static bool parked = false;
+    larmier_st_t st = { 0 };
+    char cmd;
+    pid_t pid;
+
+    // Only park once, and only if larmier asked for a fork server.
+    if (parked || getenv(LARMIER_FORKSRV) == NULL) {
+        return;
+    }
+    parked = true;
+
+    // Attach once here rather than in every child.
+    (void)larmier_get_bca();
+
+    // Fork a child for each path requested. The child returns to the test
+    // and runs it to completion against the bca loaded by larmier.
+    while (read(LARMIER_CTL_FD, &cmd, sizeof(cmd)) == sizeof(cmd)) {
+        (void)fflush(NULL);
+        pid = fork();
+        if (pid == 0) {
+            // Paths forked off by exploring still need to report back.
+            if (getenv(LARMIER_EXPLORE) == NULL) {
+                (void)close(LARMIER_CTL_FD);
+                (void)close(LARMIER_ST_FD);
+            }
+            return;
+        }
+        if (pid == -1 || wait4(pid, &st.status, 0, &st.rusage) == -1) {
+            _exit(LARMIER_EXIT_ERR);
+        }
+        if (write(LARMIER_ST_FD, &st, sizeof(st)) != sizeof(st)) {
+            break;
+        }
+    }
+
+    // Larmier is done with us.
+    _exit(EXIT_SUCCESS);
+}
+
+__attribute__ ((visibility ("default"))) void
+larmier_stub_hook(bool on)
+{
+    __atomic_store_n(&larmier_stub_on, on, __ATOMIC_RELAXED);
+
+    // The leak tracker sets its baseline before the test is parked.
+    if (larmier_track_hook != NULL) {
+        larmier_track_hook(on);
+    }
+
+    if (on) {
+        larmier_forksrv();
+    }
+}
+
+// Raise '*ptr' to 'val', unless another thread raised it further.
+static inline void
+larmier_max(uint32_t *ptr, uint32_t val)
+{
+    uint32_t old = __atomic_load_n(ptr, __ATOMIC_RELAXED);
+
+    while (old < val &&
+           !__atomic_compare_exchange_n(ptr, &old, val, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        ;
+    }
+}
+
+// As bca_set(), but other threads may be setting the call sharing its byte.
+static inline void
+larmier_set(bca_t *bca, uint32_t slot, unsigned int val)
+{
+    uint64_t bit = (uint64_t)slot * BCA_BITS;
+    uint8_t *byte = &bca->map[bit / 8];
+    uint8_t old = __atomic_load_n(byte, __ATOMIC_RELAXED);
+    uint8_t new;
+
+    do {
+        new = (old & ~(BCA_MASK << (bit % 8))) |
+              ((val & BCA_MASK) << (bit % 8));
+    } while (!__atomic_compare_exchange_n(byte, &old, new, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Record the outcome injected at 'slot', flagging the stub's last one so
+// larmier knows to try the real call next rather than another outcome.
 static inline void
-larmier_put_bca(bca_t *bca)
+larmier_record(bca_t *bca, uint32_t slot, unsigned int outcome,
+               unsigned int nout)
+{
+    unsigned int val = outcome;
+
+    if (outcome == nout - 1) {
+        val |= BCA_LAST;
+    }
+    if (bca_get(bca->map, slot) != val) {
+        larmier_set(bca, slot, val);
+    }
+    larmier_max(&bca->dirty, slot + 1);
+}
+
+static int
+larmier_explore(bca_t *bca, uint32_t slot, unsigned int nout)
+{
+    larmier_st_t st = { .flags = LARMIER_ST_LEAF };
+    unsigned int outcome;
+    char ack;
+    pid_t pid;
+
+    // A child takes each outcome in turn. The parent waits for it (and for
+    // any paths it forks in turn) before carrying on with the real call.
+    for (outcome = 0; outcome < nout; outcome++) {
+        (void)fflush(NULL);
+        pid = fork();
+        if (pid == 0) {
+            larmier_record(bca, slot, outcome, nout);
+            return outcome;
+        }
+        if (pid == -1 || wait4(pid, &st.status, 0, &st.rusage) == -1) {
+            _exit(LARMIER_EXIT_ERR);
+        }
+
+        // The child's path was left in the bca. Report it and wait for
+        // larmier to collect it before reusing the bca.
+        if (write(LARMIER_ST_FD, &st, sizeof(st)) != sizeof(st) ||
+            read(LARMIER_CTL_FD, &ack, sizeof(ack)) != sizeof(ack)) {
+            _exit(LARMIER_EXIT_ERR);
+        }
+        bca->count = slot + 1;
+    }
+
+    larmier_set(bca, slot, BCA_REAL);
+    return -1;
+}
+
+#define LARMIER_SITES_BITS 10
+#define LARMIER_SITES_MAX  (1 << LARMIER_SITES_BITS)
+
+// Call sites (return addresses) of the stubbed calls made by this thread
+// since its last injection, for dedup. Once full, further sites are simply
+// not pruned.
+static __thread uintptr_t larmier_sites[LARMIER_SITES_MAX];
+static __thread unsigned int larmier_nsites = 0;
+
+// Whether 'site' was called since the last injection, adding it if not.
+static bool
+larmier_site_seen(uintptr_t site)
 {
-    if (bca == MAP_FAILED) {
+    unsigned int i;
+
+    i = (site * 0x9e3779b97f4a7c15ULL) >> (64 - LARMIER_SITES_BITS);
+    while (larmier_sites[i] != 0) {
+        if (larmier_sites[i] == site) {
+            return true;
+        }
+        i = (i + 1) % LARMIER_SITES_MAX;
+    }
+    if (larmier_nsites < LARMIER_SITES_MAX * 3 / 4) {
+        larmier_sites[i] = site;
+        larmier_nsites++;
+    }
+
+    return false;
+}
+
+static inline void
+larmier_sites_clear(void)
+{
+    if (larmier_nsites > 0) {
+        (void)memset(larmier_sites, 0, sizeof(larmier_sites));
+        larmier_nsites = 0;
+    }
+}
+
+// Top of the main thread's stack, as set up by glibc.
+extern void *__libc_stack_end;
+
+#define LARMIER_STACK_MAX (64 << 20)    // Further below, not the main stack
+#define LARMIER_STACK_SKIP 4            // Frames of the stubs runtime itself
+
+// Record where the failure injected at 'slot' came from in the bca's ring,
+// without looking anything up. Frame pointers are only followed within the
+// main thread's stack, where they can be read safely, and while they lead to
+// the main program. Otherwise, only the call site is recorded.
+static void
+larmier_backtrace(bca_t *bca, uint32_t slot, void *site)
+{
+    int nranges = __atomic_load_n(&larmier_nranges, __ATOMIC_ACQUIRE);
+    uintptr_t top = (uintptr_t)__libc_stack_end;
+    uintptr_t *fp = __builtin_frame_address(0);
+    bca_trace_t *trace;
+    uintptr_t *next;
+    bool found = false;
+    uint32_t seq;
+    int skip = 0;
+
+    seq = __atomic_add_fetch(&bca->traces, 1, __ATOMIC_RELAXED);
+    trace = &bca->ring[(seq - 1) % BCA_RING];
+    trace->seq = seq;
+    trace->slot = slot;
+    trace->base = larmier_base;
+    trace->frames[0] = (uintptr_t)site;
+    trace->nframes = 1;
+
+    if ((uintptr_t)fp >= top || top - (uintptr_t)fp > LARMIER_STACK_MAX) {
         return;
     }
 
-    (void)munmap(bca, LARMIER_LEN);
+    // Skip frames up to the stub's own (which returns to 'site'), then
+    // record its callers.
+    while ((uintptr_t)(fp + 2) <= top && trace->nframes < BCA_FRAMES) {
+        if (found) {
+            if (!larmier_in_main(fp[1], nranges)) {
+                break;
+            }
+            trace->frames[trace->nframes++] = fp[1];
+        } else if (fp[1] == (uintptr_t)site) {
+            found = true;
+        } else if (++skip > LARMIER_STACK_SKIP) {
+            break;
+        }
+        next = (uintptr_t *)fp[0];
+        if (next <= fp || ((uintptr_t)next % sizeof(*next)) != 0) {
+            break;
+        }
+        fp = next;
+    }
+}
+
+// The stream this thread makes its calls on, see bca_t. The main thread's
+// is 0, others are numbered as they are created.
+static __thread uint32_t larmier_stream = 0;
+static uint32_t larmier_threads __attribute__((unused)) = 1;
+
+#ifndef LARMIER_NO_STREAMS
+
+typedef struct {
+    void *(*start)(void *);
+    void *arg;
+    uint32_t stream;
+} larmier_thread_t;
+
+static void *
+larmier_thread(void *data)
+{
+    larmier_thread_t thread = *(larmier_thread_t *)data;
+
+    free(data);
+    larmier_stream = thread.stream;
+
+    return thread.start(thread.arg);
+}
+
+// Number threads as they are created, for streams. Stub libraries which stub
+// pthread_create() themselves must define LARMIER_NO_STREAMS, and all their
+// threads then share the main thread's stream.
+__attribute__ ((visibility ("default"))) int
+pthread_create(pthread_t *tid, const pthread_attr_t *attr,
+               void *(*start)(void *), void *arg)
+{
+    static void *real;
+    larmier_thread_t *thread;
+    bca_t *bca;
+    int (*func)();
+    int err;
+
+    func = larmier_real(&real, NULL, "pthread_create");
+    if (stub_off) {
+        return func(tid, attr, start, arg);
+    }
+
+    // Attaching makes calls which may be stubbed too.
+    stub_off = true;
+    bca = larmier_get_bca();
+    stub_off = false;
+    if (bca == MAP_FAILED || bca->streams <= 1) {
+        return func(tid, attr, start, arg);
+    }
+
+    thread = malloc(sizeof(*thread));
+    if (thread == NULL) {
+        return EAGAIN;
+    }
+    thread->start = start;
+    thread->arg = arg;
+    thread->stream = __atomic_fetch_add(&larmier_threads, 1,
+                                        __ATOMIC_RELAXED);
+
+    err = func(tid, attr, larmier_thread, thread);
+    if (err != 0) {
+        free(thread);
+    }
+
+    return err;
 }
 
+#endif /* LARMIER_NO_STREAMS */
+
+// Allocate the next call of this thread's stream. With a single stream,
+// that is simply the next call, whichever thread makes it.
+static inline uint32_t
+larmier_slot(bca_t *bca)
+{
+    uint32_t streams = bca->streams;
+    uint32_t stream;
+    uint32_t slot;
+
+    if (streams <= 1) {
+        return __atomic_fetch_add(&bca->count, 1, __ATOMIC_RELAXED);
+    }
+
+    // Threads beyond the last stream share it.
+    stream = (larmier_stream < streams) ? larmier_stream : streams - 1;
+    slot = __atomic_fetch_add(&bca->calls[stream], 1, __ATOMIC_RELAXED) *
+           streams + stream;
+    larmier_max(&bca->count, slot + 1);
+
+    return slot;
+}
+
+// Returns the outcome to inject for this call (out of 'nout'), or -1 to
+// make the real call. 'site' is where the stub was called from.
+static inline int
+larmier_inject(bca_t *bca, unsigned int nout, void *site)
+{
+    uint32_t slot = larmier_slot(bca);
+    unsigned int val;
+    int outcome;
+
+    bca = larmier_bca_for(slot);
+
+    // With dedup, a site called again with the same failures injected so
+    // far is deemed to lead to the same paths. Beyond the prefix loaded by
+    // larmier, it isn't failed again (or queued by larmier) until another
+    // call fails.
+    if (larmier_dedup && larmier_site_seen((uintptr_t)site) &&
+        slot >= bca->prefix) {
+        larmier_record(bca, slot, BCA_REAL, nout);
+        __atomic_add_fetch(&bca->pruned, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    // Calls within the prefix loaded by larmier follow the bca. Those its
+    // stream didn't get to when the path was found are made for real.
+    if (slot < bca->prefix || !larmier_exploring) {
+        val = BCA_OUTCOME(bca_get(bca->map, slot));
+        if (val == BCA_UNUSED) {
+            larmier_record(bca, slot, BCA_REAL, nout);
+            return -1;
+        }
+        if (val == BCA_REAL) {
+            return -1;
+        }
+        if (val >= nout) {
+            val = nout - 1;
+        }
+        larmier_record(bca, slot, val, nout);
+        outcome = val;
+    } else if (!__atomic_load_n(&larmier_failed, __ATOMIC_RELAXED) &&
+               bca->shards > 1 && slot % bca->shards != bca->shard) {
+        // Paths failing this call first are another shard's.
+        larmier_set(bca, slot, BCA_REAL);
+        return -1;
+    } else {
+        outcome = larmier_explore(bca, slot, nout);
+    }
+
+    // Calls after a failure start a new history.
+    if (outcome >= 0) {
+        __atomic_store_n(&larmier_failed, true, __ATOMIC_RELAXED);
+        larmier_sites_clear();
+        larmier_backtrace(bca, slot, site);
+    }
+
+    return outcome;
+}
+
+// Stubs libraries built with LARMIER_STUB_VERBOSE defined (eg. by including
+// larmier_stub_verbose.h) trace every stubbed call on stderr, along with where
+// it came from and whether it was failed ('0', 'a', ...) or made for real.
+#ifdef LARMIER_STUB_VERBOSE
+static void
+larmier_verbose(const char *name, int outcome, void *site)
+{
+    const char *sym = "?";
+    uintptr_t base = 0;
+    Dl_info di;
+    char c;
+
+    if (dladdr(site, &di) != 0) {
+        sym = (di.dli_sname != NULL) ? di.dli_sname : di.dli_fname;
+        base = (uintptr_t)((di.dli_sname != NULL) ? di.dli_saddr :
+                                                    di.dli_fbase);
+    }
+    c = (outcome < 0) ? '1' : (outcome == 0) ? '0' : 'a' + outcome - 1;
+
+    dprintf(STDERR_FILENO, "larmier: %s() from %s+0x%lx: %c\n", name, sym,
+            (unsigned long)((uintptr_t)site - base), c);
+}
+#else
+#define larmier_verbose(name, outcome, site) do { } while (0)
+#endif
+
 #define PP_NARGM(...) PP_NARG_(__VA_ARGS__, PP_RSEQ_NM())
 
 #define PP_NARG(...) \
@@ -233,38 +783,49 @@ larmier_put_bca(bca_t *bca)
 
 #define _LEXP(n, x, ...) _LEXP##n(x, __VA_ARGS__)
 
-#define _LSDEFn(lib, n, type, name, ...)                        \
+#define _LSDEFn(lib, nout, n, type, name, ...)                  \
     static inline type                                          \
     lstub_##name(_LEXP(n, ta, __VA_ARGS__));                    \
                                                                 \
     __attribute__ ((visibility ("default"))) type               \
     name(_LEXP(n, ta, __VA_ARGS__))                             \
     {                                                           \
+        _Static_assert((nout) > 0 && (nout) <= BCA_OUTCOMES,    \
+                       "Too many outcomes");                    \
+        static void *real;                                      \
         bca_t *bca;                                             \
+        int outcome;                                            \
         bool stub_off_old = stub_off;                           \
         type ret;                                               \
-        void *libp;                                             \
         type (*func)();                                         \
-        stub_off = true;                                        \
-        libp = dlopen(lib, RTLD_GLOBAL | RTLD_LAZY);            \
-        func = dlsym(libp, #name);                              \
-        dlclose(libp);                                          \
-        stub_off = stub_off_old;                                \
-        if (stub_off || dont_stub()) {                          \
+        func = __atomic_load_n(&real, __ATOMIC_ACQUIRE);        \
+        if (func == NULL) {                                     \
+            stub_off = true;                                    \
+            func = larmier_real(&real, lib, #name);             \
+            stub_off = stub_off_old;                            \
+        }                                                       \
+        if (stub_off) {                                         \
             return func(_LEXP(n, a, __VA_ARGS__));              \
         }                                                       \
+        /* Attaching makes calls which may be stubbed too. */   \
         stub_off = true;                                        \
         bca = larmier_get_bca();                                \
-        if (bca != MAP_FAILED) {                                \
-            if (bca->map[bca->count++] == 0) {                  \
-                print_trace();                                  \
-                ret = lstub_##name(_LEXP(n, a, __VA_ARGS__));   \
-                goto out;                                       \
-            }                                                   \
+        if (bca == MAP_FAILED ||                                \
+            dont_stub(__builtin_return_address(0))) {           \
+            stub_off = stub_off_old;                            \
+            return func(_LEXP(n, a, __VA_ARGS__));              \
+        }                                                       \
+        outcome = larmier_inject(bca, nout,                     \
+                                 __builtin_return_address(0));  \
+        larmier_verbose(#name, outcome,                         \
+                        __builtin_return_address(0));           \
+        if (outcome >= 0) {                                     \
+            larmier_outcome = outcome;                          \
+            ret = lstub_##name(_LEXP(n, a, __VA_ARGS__));       \
+            goto out;                                           \
         }                                                       \
         ret = func(_LEXP(n, a, __VA_ARGS__));                   \
     out:                                                        \
-        larmier_put_bca(bca);                                   \
         stub_off = stub_off_old;                                \
         return ret;                                             \
     }                                                           \
@@ -279,7 +840,9 @@ larmier_put_bca(bca_t *bca)
     __attribute__ ((visibility ("default"))) void *             \
     calloc(size_t nmemb, size_t size)                           \
     {                                                           \
+        static void *real;                                      \
         bca_t *bca;                                             \
+        int outcome;                                            \
         void *(*func)();                                        \
         void *ret;                                              \
         if (in_dlsym) {                                         \
@@ -288,57 +851,83 @@ larmier_put_bca(bca_t *bca)
             errno = ENOMEM;                                     \
             return NULL;                                        \
         }                                                       \
-        in_dlsym = true;                                        \
-        func = dlsym(RTLD_NEXT, "calloc");                      \
-        in_dlsym = false;                                       \
+        func = __atomic_load_n(&real, __ATOMIC_ACQUIRE);        \
+        if (func == NULL) {                                     \
+            in_dlsym = true;                                    \
+            func = larmier_real(&real, NULL, "calloc");         \
+            in_dlsym = false;                                   \
+        }                                                       \
+        if (stub_off) {                                         \
+            return func(nmemb, size);                           \
+        }                                                       \
+        /* Attaching makes calls which may be stubbed too. */   \
+        stub_off = true;                                        \
         bca = larmier_get_bca();                                \
-        if (!stub_off && !dont_stub() && bca != MAP_FAILED) {   \
-            if (bca->map[bca->count++] == 0) {                  \
-                print_trace();                                  \
-                ret = lstub_calloc(nmemb, size);                \
-                goto out;                                       \
-            }                                                   \
+        if (bca == MAP_FAILED ||                                \
+            dont_stub(__builtin_return_address(0))) {           \
+            stub_off = false;                                   \
+            return func(nmemb, size);                           \
+        }                                                       \
+        outcome = larmier_inject(bca, 1,                        \
+                                 __builtin_return_address(0));  \
+        larmier_verbose("calloc", outcome,                      \
+                        __builtin_return_address(0));           \
+        if (outcome >= 0) {                                     \
+            larmier_outcome = outcome;                          \
+            ret = lstub_calloc(nmemb, size);                    \
+            goto out;                                           \
         }                                                       \
         ret = func(nmemb, size);                                \
     out:                                                        \
-        larmier_put_bca(bca);                                   \
+        stub_off = false;                                       \
         return ret;                                             \
     }                                                           \
                                                                 \
     static inline void *                                        \
     lstub_calloc(size_t nmemb, size_t size)
 
-#define _LSDEFv(n, type, name, vname, ...)                      \
+#define _LSDEFv(nout, n, type, name, vname, ...)                \
     static inline type                                          \
     lstub_##name(_LEXP(n, ta, __VA_ARGS__), ...);               \
                                                                 \
     __attribute__ ((visibility ("default"))) type               \
     name(_LEXP(n, ta, __VA_ARGS__), ...)                        \
     {                                                           \
+        _Static_assert((nout) > 0 && (nout) <= BCA_OUTCOMES,    \
+                       "Too many outcomes");                    \
+        static void *real;                                      \
         bca_t *bca;                                             \
+        int outcome;                                            \
         va_list ap;                                             \
-        type (*func)() = dlsym(RTLD_NEXT, #vname);              \
+        type (*func)() = larmier_real(&real, NULL, #vname);     \
         type ret;                                               \
         bool stub_off_old = stub_off;                           \
         va_start(ap, GET_NTHM(__VA_ARGS__));                    \
-        if (stub_off || dont_stub()) {                          \
+        if (stub_off) {                                         \
             ret = func(_LEXP(n, a, __VA_ARGS__), ap);           \
             va_end(ap);                                         \
             return ret;                                         \
         }                                                       \
+        /* Attaching makes calls which may be stubbed too. */   \
         stub_off = true;                                        \
         bca = larmier_get_bca();                                \
-        if (bca != MAP_FAILED) {                                \
-            if (bca->map[bca->count++] == 0) {                  \
-                print_trace();                                  \
-                ret = lstub_##name(_LEXP(n, a, __VA_ARGS__), ap);\
-                goto out;                                       \
-            }                                                   \
+        if (bca == MAP_FAILED ||                                \
+            dont_stub(__builtin_return_address(0))) {           \
+            ret = func(_LEXP(n, a, __VA_ARGS__), ap);           \
+            goto out;                                           \
+        }                                                       \
+        outcome = larmier_inject(bca, nout,                     \
+                                 __builtin_return_address(0));  \
+        larmier_verbose(#name, outcome,                         \
+                        __builtin_return_address(0));           \
+        if (outcome >= 0) {                                     \
+            larmier_outcome = outcome;                          \
+            ret = lstub_##name(_LEXP(n, a, __VA_ARGS__), ap);   \
+            goto out;                                           \
         }                                                       \
         ret = func(_LEXP(n, a, __VA_ARGS__), ap);               \
     out:                                                        \
         va_end(ap);                                             \
-        larmier_put_bca(bca);                                   \
         stub_off = stub_off_old;                                \
         return ret;                                             \
     }                                                           \
@@ -346,8 +935,14 @@ larmier_put_bca(bca_t *bca)
     static inline type                                          \
     lstub_##name(_LEXP(n, tau, __VA_ARGS__), ...)
 
-#define LSDEF(type, name, ...)  _LSDEFn("libc.so.6", PP_NARG(__VA_ARGS__), type, name, __VA_ARGS__)
-#define LSDEFlib(lib, type, name, ...)  _LSDEFn(lib, PP_NARG(__VA_ARGS__), type, name, __VA_ARGS__)
-#define LSDEFv(type, name, vname, ...) _LSDEFv(PP_NARG(__VA_ARGS__), type, name, vname, __VA_ARGS__)
+#define LSDEF(type, name, ...)  _LSDEFn("libc.so.6", 1, PP_NARG(__VA_ARGS__), type, name, __VA_ARGS__)
+#define LSDEFlib(lib, type, name, ...)  _LSDEFn(lib, 1, PP_NARG(__VA_ARGS__), type, name, __VA_ARGS__)
+#define LSDEFv(type, name, vname, ...) _LSDEFv(1, PP_NARG(__VA_ARGS__), type, name, vname, __VA_ARGS__)
+
+// Stubs with 'nout' alternative outcomes (up to BCA_OUTCOMES). Each one is
+// explored in turn, with the body told which through 'larmier_outcome'.
+#define LSDEFo(nout, type, name, ...)  _LSDEFn("libc.so.6", nout, PP_NARG(__VA_ARGS__), type, name, __VA_ARGS__)
+#define LSDEFlibo(lib, nout, type, name, ...)  _LSDEFn(lib, nout, PP_NARG(__VA_ARGS__), type, name, __VA_ARGS__)
+#define LSDEFvo(nout, type, name, vname, ...) _LSDEFv(nout, PP_NARG(__VA_ARGS__), type, name, vname, __VA_ARGS__)
 
 #endif /* LARMIER_STUB_H */
@@ -0,0 +1,521 @@
+/*
+ * Copyright (c) 2019 Nutanix Inc. All rights reserved.
+ *
+ * Author: Felipe Franciosi <felipe@nutanix.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Lightweight leak tracker, preloaded by larmier (after any stubs library)
+ * with '--backend track'.
+ *
+ * Allocations are kept in a table until free()d. Those made while stubbing
+ * is off are only used as roots, as blocks the test allocated up front (eg.
+ * a global container) may hold the only pointers to later ones. Descriptors
+ * open when stubbing is first turned on form a baseline. When the test exits,
+ * allocations which can't be reached from any global data (like valgrind's
+ * "definitely lost") and descriptors not in the baseline are reported to
+ * larmier in the bca header.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <link.h>
+#include <malloc.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/auxv.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "larmier.h"
+
+#define TRACK_EXPORT __attribute__ ((visibility ("default")))
+
+#define TRACK_HEAP_INIT 4096    // Initial slots in the allocation table
+#define TRACK_FDS_MAX   4096    // Descriptors beyond this are not tracked
+
+// Table slots hold a pointer, or one of these. Pointers are flagged as roots
+// when allocated while stubbing is off, and marked as reachable when scanning
+// for leaks.
+#define TRACK_EMPTY     ((uintptr_t)0)
+#define TRACK_DELETED   ((uintptr_t)1)
+#define TRACK_MARK      ((uintptr_t)2)
+#define TRACK_ROOT      ((uintptr_t)4)
+#define TRACK_FLAGS     (TRACK_MARK | TRACK_ROOT)
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+// Live allocations (open addressing, linear probing). The table is mmap()ed
+// so it doesn't allocate from the heap it tracks.
+static struct {
+    uintptr_t *slots;
+    size_t size;                // Always a power of two
+    size_t used;                // Live and deleted slots
+    size_t live;
+    size_t roots;               // Live slots with TRACK_ROOT
+} track_heap;
+
+static bool track_lock = false;
+static bool track_on = false;
+static bool track_started = false;
+static bool track_lost = false;         // An allocation couldn't be tracked
+static uint64_t track_fds[TRACK_FDS_MAX / 64];
+
+// Code of the dynamic loader. What it allocates (eg. when the stubs runtime
+// dlopen()s a library) is only reachable from its private mappings.
+static uintptr_t track_loader_start;
+static uintptr_t track_loader_end;
+
+static int
+track_loader_cb(struct dl_phdr_info *info, size_t size, void *data)
+{
+    const ElfW(Phdr) *phdr;
+    uintptr_t start;
+    int i;
+
+    if (info->dlpi_addr != getauxval(AT_BASE)) {
+        return 0;
+    }
+
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X)) {
+            continue;
+        }
+        start = info->dlpi_addr + phdr->p_vaddr;
+        if (track_loader_start == 0 || start < track_loader_start) {
+            track_loader_start = start;
+        }
+        if (start + phdr->p_memsz > track_loader_end) {
+            track_loader_end = start + phdr->p_memsz;
+        }
+    }
+
+    return 1;
+}
+
+static inline void
+track_heap_lock(void)
+{
+    while (__atomic_test_and_set(&track_lock, __ATOMIC_ACQUIRE)) {
+        ;
+    }
+}
+
+static inline void
+track_heap_unlock(void)
+{
+    __atomic_clear(&track_lock, __ATOMIC_RELEASE);
+}
+
+static inline size_t
+track_heap_hash(uintptr_t ptr)
+{
+    return (size_t)((ptr >> 4) * 0x9E3779B97F4A7C15ULL);
+}
+
+static void
+track_heap_insert(uintptr_t *slots, size_t size, uintptr_t ptr)
+{
+    size_t i = track_heap_hash(ptr) & (size - 1);
+
+    while (slots[i] != TRACK_EMPTY && slots[i] != TRACK_DELETED) {
+        i = (i + 1) & (size - 1);
+    }
+    slots[i] = ptr;
+}
+
+// Rehash into a table twice the size of the live entries (or more). Failing
+// to do so stops reporting leaks, as a root may be missing and there is no
+// way to report that either.
+static int
+track_heap_resize(void)
+{
+    size_t size = TRACK_HEAP_INIT;
+    uintptr_t *slots;
+    size_t i;
+
+    while (size < track_heap.live * 4) {
+        size *= 2;
+    }
+
+    slots = mmap(NULL, size * sizeof(*slots), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED) {
+        track_lost = true;
+        return -1;
+    }
+
+    for (i = 0; i < track_heap.size; i++) {
+        if (track_heap.slots[i] > TRACK_DELETED) {
+            track_heap_insert(slots, size, track_heap.slots[i]);
+        }
+    }
+    if (track_heap.slots != NULL) {
+        (void)munmap(track_heap.slots,
+                     track_heap.size * sizeof(*track_heap.slots));
+    }
+
+    track_heap.slots = slots;
+    track_heap.size = size;
+    track_heap.used = track_heap.live;
+
+    return 0;
+}
+
+// Tracks a pointer, with TRACK_ROOT in 'slot' or not.
+static void
+track_heap_put(uintptr_t slot)
+{
+    track_heap_lock();
+    if ((track_heap.used + 1) * 4 <= track_heap.size * 3 ||
+        track_heap_resize() == 0) {
+        track_heap_insert(track_heap.slots, track_heap.size, slot);
+        track_heap.used++;
+        track_heap.live++;
+        if (slot & TRACK_ROOT) {
+            track_heap.roots++;
+        }
+    }
+    track_heap_unlock();
+}
+
+// Tracks 'ptr', only as a root unless stubbing is on and it wasn't allocated
+// by the loader.
+static void
+track_heap_add(void *ptr, void *caller)
+{
+    uintptr_t slot = (uintptr_t)ptr;
+
+    if (ptr == NULL) {
+        return;
+    }
+    if (!__atomic_load_n(&track_on, __ATOMIC_RELAXED) ||
+        ((uintptr_t)caller >= track_loader_start &&
+         (uintptr_t)caller < track_loader_end)) {
+        slot |= TRACK_ROOT;
+    }
+
+    track_heap_put(slot);
+}
+
+// Returns the slot holding 'ptr', or NULL.
+static uintptr_t *
+track_heap_find(uintptr_t ptr)
+{
+    size_t i;
+
+    if (ptr <= TRACK_MARK || track_heap.live == 0) {
+        return NULL;
+    }
+
+    i = track_heap_hash(ptr) & (track_heap.size - 1);
+    while (track_heap.slots[i] != TRACK_EMPTY) {
+        if ((track_heap.slots[i] & ~TRACK_FLAGS) == ptr) {
+            return &track_heap.slots[i];
+        }
+        i = (i + 1) & (track_heap.size - 1);
+    }
+
+    return NULL;
+}
+
+// Returns the slot 'ptr' was tracked with, or TRACK_EMPTY.
+static uintptr_t
+track_heap_del(void *ptr)
+{
+    uintptr_t *slot, old = TRACK_EMPTY;
+
+    if (ptr == NULL || track_heap.live == 0) {
+        return TRACK_EMPTY;
+    }
+
+    track_heap_lock();
+    slot = track_heap_find((uintptr_t)ptr);
+    if (slot != NULL) {
+        old = *slot;
+        *slot = TRACK_DELETED;
+        track_heap.live--;
+        if (old & TRACK_ROOT) {
+            track_heap.roots--;
+        }
+    }
+    track_heap_unlock();
+
+    return old;
+}
+
+// Marks tracked allocations pointed to from [start, end), queueing them to
+// be scanned in turn.
+static void
+track_heap_scan(uintptr_t start, uintptr_t end, uintptr_t *queue,
+                size_t *queued)
+{
+    uintptr_t *word, *slot;
+
+    start = (start + sizeof(*word) - 1) & ~(sizeof(*word) - 1);
+    for (word = (uintptr_t *)start; (uintptr_t)(word + 1) <= end; word++) {
+        slot = track_heap_find(*word);
+        if (slot != NULL && !(*slot & TRACK_MARK)) {
+            *slot |= TRACK_MARK;
+            queue[(*queued)++] = *word;
+        }
+    }
+}
+
+static int
+track_roots_cb(struct dl_phdr_info *info, size_t size, void *data)
+{
+    uintptr_t **args = data;
+    const ElfW(Phdr) *phdr;
+    uintptr_t start;
+    int i;
+
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_W)) {
+            continue;
+        }
+        start = info->dlpi_addr + phdr->p_vaddr;
+        track_heap_scan(start, start + phdr->p_memsz, args[0],
+                        (size_t *)args[1]);
+    }
+
+    return 0;
+}
+
+// Returns how many tracked allocations (other than roots) can't be reached
+// from roots or the writable segments of any loaded object, either directly
+// or through other allocations. Stacks aren't scanned, as the test is
+// exiting.
+static unsigned int
+track_heap_leaks(void)
+{
+    size_t len = track_heap.live * sizeof(uintptr_t);
+    size_t queued = 0, scanned = 0;
+    uintptr_t *queue;
+    void *args[2];
+    size_t i;
+
+    if (track_lost || track_heap.live == track_heap.roots) {
+        return 0;
+    }
+
+    queue = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (queue == MAP_FAILED) {
+        // Report everything rather than nothing.
+        return track_heap.live - track_heap.roots;
+    }
+
+    for (i = 0; i < track_heap.size; i++) {
+        if (track_heap.slots[i] > TRACK_DELETED &&
+            (track_heap.slots[i] & TRACK_ROOT)) {
+            queue[queued++] = track_heap.slots[i] & ~TRACK_FLAGS;
+            track_heap.slots[i] |= TRACK_MARK;
+        }
+    }
+
+    args[0] = queue;
+    args[1] = &queued;
+    (void)dl_iterate_phdr(track_roots_cb, args);
+    while (scanned < queued) {
+        track_heap_scan(queue[scanned],
+                        queue[scanned] +
+                        malloc_usable_size((void *)queue[scanned]),
+                        queue, &queued);
+        scanned++;
+    }
+    (void)munmap(queue, len);
+
+    return track_heap.live - queued;
+}
+
+// Marks open descriptors in 'fds' and returns how many weren't in 'base'.
+static unsigned int
+track_fds_scan(uint64_t *fds, const uint64_t *base)
+{
+    unsigned int count = 0;
+    struct dirent *de;
+    DIR *dir;
+    long fd;
+
+    dir = opendir("/proc/self/fd");
+    if (dir == NULL) {
+        return 0;
+    }
+
+    while ((de = readdir(dir)) != NULL) {
+        fd = strtol(de->d_name, NULL, 10);
+        if (de->d_name[0] == '.' || fd == dirfd(dir) || fd >= TRACK_FDS_MAX ||
+            fd == LARMIER_CTL_FD || fd == LARMIER_ST_FD) {
+            continue;
+        }
+        if (fds != NULL) {
+            fds[fd / 64] |= 1ULL << (fd % 64);
+        }
+        if (base != NULL && !(base[fd / 64] & (1ULL << (fd % 64)))) {
+            count++;
+        }
+    }
+    (void)closedir(dir);
+
+    return count;
+}
+
+// Called by the stubs runtime whenever larmier_stub() is.
+TRACK_EXPORT void
+larmier_track_hook(bool on)
+{
+    if (on && !track_started) {
+        (void)dl_iterate_phdr(track_loader_cb, NULL);
+        (void)track_fds_scan(track_fds, NULL);
+        track_started = true;
+    }
+
+    __atomic_store_n(&track_on, on, __ATOMIC_RELAXED);
+}
+
+__attribute__((destructor)) static void
+track_report(void)
+{
+    char *bca_name = getenv(LARMIER_BCA);
+    unsigned int heap_leaks, fd_leaks;
+    bca_t *bca;
+    int bca_fd;
+
+    if (!track_started || bca_name == NULL) {
+        return;
+    }
+    __atomic_store_n(&track_on, false, __ATOMIC_RELAXED);
+
+    heap_leaks = track_heap_leaks();
+    fd_leaks = track_fds_scan(NULL, track_fds);
+    if (heap_leaks == 0 && fd_leaks == 0) {
+        return;
+    }
+
+    // Only the header is needed, which never moves.
+    bca_fd = shm_open(bca_name, O_RDWR, 0600);
+    if (bca_fd < 0) {
+        return;
+    }
+    bca = mmap(NULL, sizeof(*bca), PROT_READ | PROT_WRITE, MAP_SHARED,
+               bca_fd, 0);
+    (void)close(bca_fd);
+    if (bca == MAP_FAILED) {
+        return;
+    }
+
+    bca->heap_leaks = heap_leaks;
+    bca->fd_leaks = fd_leaks;
+    (void)munmap(bca, sizeof(*bca));
+}
+
+TRACK_EXPORT void *
+malloc(size_t size)
+{
+    void *ptr = __libc_malloc(size);
+
+    track_heap_add(ptr, __builtin_return_address(0));
+    return ptr;
+}
+
+TRACK_EXPORT void *
+calloc(size_t nmemb, size_t size)
+{
+    void *ptr = __libc_calloc(nmemb, size);
+
+    track_heap_add(ptr, __builtin_return_address(0));
+    return ptr;
+}
+
+TRACK_EXPORT void *
+realloc(void *ptr, size_t size)
+{
+    void *caller = __builtin_return_address(0);
+    uintptr_t old;
+    void *new_ptr;
+
+    // A reallocated block is still the same allocation.
+    old = track_heap_del(ptr);
+    new_ptr = __libc_realloc(ptr, size);
+    if (old == TRACK_EMPTY) {
+        track_heap_add(new_ptr, caller);
+    } else if (new_ptr != NULL) {
+        track_heap_put((uintptr_t)new_ptr | (old & TRACK_ROOT));
+    } else if (size != 0) {
+        // The original block is left untouched.
+        track_heap_put(old);
+    }
+
+    return new_ptr;
+}
+
+TRACK_EXPORT void
+free(void *ptr)
+{
+    (void)track_heap_del(ptr);
+    __libc_free(ptr);
+}
+
+static void *
+track_memalign(size_t alignment, size_t size, void *caller)
+{
+    void *ptr = __libc_memalign(alignment, size);
+
+    track_heap_add(ptr, caller);
+    return ptr;
+}
+
+TRACK_EXPORT void *
+memalign(size_t alignment, size_t size)
+{
+    return track_memalign(alignment, size, __builtin_return_address(0));
+}
+
+TRACK_EXPORT void *
+aligned_alloc(size_t alignment, size_t size)
+{
+    return track_memalign(alignment, size, __builtin_return_address(0));
+}
+
+TRACK_EXPORT int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *ptr;
+
+    if (alignment % sizeof(void *) != 0 ||
+        (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+
+    ptr = track_memalign(alignment, size, __builtin_return_address(0));
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+
+    return 0;
+}
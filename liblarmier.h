@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2019 Nutanix Inc. All rights reserved.
+ *
+ * Author: Felipe Franciosi <felipe@nutanix.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBLARMIER_H
+#define LIBLARMIER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LARMIER_API __attribute__ ((visibility ("default")))
+
+// What an exploration (or a path) ended with. Either the test passed every
+// path, and the low byte is the exit status of the path with no injections,
+// or a path failed, and the low byte tells how.
+#define LARMIER_RESULT_TEST     0x100
+#define LARMIER_RESULT_SYSTEM   0x200
+
+#define LARMIER_FAIL_TIMEOUT    0xFA
+#define LARMIER_FAIL_ABNORMAL   0xFB
+#define LARMIER_FAIL_FDLEAKS    0xFC
+#define LARMIER_FAIL_LARMIER    0xFD    // Same as LARMIER_EXIT_ERR
+#define LARMIER_FAIL_VALGRIND   0xFE    // Also used by sanitizers
+
+// A path explored, as written by --report. Only valid during the callback.
+typedef struct larmier_result {
+    const char *path;           // Every call made, eg. "01a1"
+    const char *exit_class;     // "OK", "TIMEOUT", "VALGRIND", etc.
+    int err;                    // Zero, or LARMIER_RESULT_SYSTEM | <how>
+    int status;                 // Exit status, or minus the killing signal
+    int64_t wall_us;
+    int64_t user_us;
+    int64_t sys_us;
+    long maxrss_kb;
+} larmier_result_t;
+
+typedef void (*larmier_result_cb_t)(const larmier_result_t *result,
+                                    void *data);
+
+typedef struct larmier larmier_t;
+
+// Sets up explorations with options as on larmier's command line, without a
+// test (argv[0] is only used in messages). Valgrind and the leak tracker are
+// located here, once. Returns NULL, having said why on stderr, on errors.
+LARMIER_API larmier_t *
+larmier_open(int argc, char **argv);
+
+// Explores the test in 'argv', calling 'cb' (unless NULL) with every path it
+// runs (none for verdicts taken from --cache). Returns LARMIER_RESULT_TEST or
+// LARMIER_RESULT_SYSTEM with the low byte as above, like larmier's "exit
+// status" with -d, or -1 if the exploration could not start. Branch control
+// arrays are kept between calls. Explorations can't run concurrently, in the
+// same process.
+LARMIER_API int
+larmier_run(larmier_t *larmier, int argc, char **argv,
+            larmier_result_cb_t cb, void *data);
+
+LARMIER_API void
+larmier_close(larmier_t *larmier);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBLARMIER_H */
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2019 Nutanix Inc. All rights reserved.
+ *
+ * Author: Felipe Franciosi <felipe@nutanix.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "liblarmier.h"
+
+// Explores test2 (which passes) and test2_leak (which doesn't) with the
+// options given, from the same explorer.
+typedef struct driver_run {
+    char *test;
+    int expected;               // Whether it should fail
+    unsigned int paths;
+    unsigned int failed;
+} driver_run_t;
+
+static void
+driver_result(const larmier_result_t *result, void *data)
+{
+    driver_run_t *run = data;
+
+    run->paths++;
+    if (result->err != 0) {
+        run->failed++;
+        printf("%s: path %s failed (%s)\n", run->test, result->path,
+               result->exit_class);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    driver_run_t runs[] = {
+        { "./test2",        0 },
+        { "./test2_leak",   LARMIER_RESULT_SYSTEM },
+    };
+    larmier_t *larmier;
+    int ret = EXIT_SUCCESS;
+    unsigned int i;
+    int err;
+
+    larmier = larmier_open(argc, argv);
+    if (larmier == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+        err = larmier_run(larmier, 1, &runs[i].test, driver_result, &runs[i]);
+        printf("%s: %u paths, %u failed, result 0x%X\n", runs[i].test,
+               runs[i].paths, runs[i].failed, err);
+        if (err == -1 || runs[i].paths == 0 ||
+            (err & LARMIER_RESULT_SYSTEM) != runs[i].expected ||
+            (runs[i].failed != 0) != (runs[i].expected != 0)) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    larmier_close(larmier);
+
+    return ret;
+}
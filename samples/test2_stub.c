@@ -35,8 +35,10 @@ LSDEF(char *, strdup, const char *, s)
     return NULL;
 }
 
-LSDEF(int, fputs, const char *, s, FILE *, stream)
+LSDEFo(2, int, fputs, const char *, s, FILE *, stream)
 {
-    errno = EIO;
+    static const int errs[] = { EIO, ENOSPC };
+
+    errno = errs[larmier_outcome];
     return -1;
 }
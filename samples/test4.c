@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2019 Nutanix Inc. All rights reserved.
+ *
+ * Author: Felipe Franciosi <felipe@nutanix.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "larmier.h"
+
+#define THREADS 3
+#define ALLOCS  2
+
+static void *
+worker(void *arg)
+{
+    char *mem[ALLOCS];
+    int i;
+
+    (void)arg;
+
+    // Allocate concurrently with the other threads.
+    for (i = 0; i < ALLOCS; i++) {
+        mem[i] = calloc(1, 16);
+        if (mem[i] == NULL) {
+            perror("calloc");
+        }
+    }
+
+    for (i = 0; i < ALLOCS; i++) {
+        free(mem[i]);
+    }
+
+    return NULL;
+}
+
+int
+main(void)
+{
+    pthread_t threads[THREADS];
+    int ret = EXIT_FAILURE;
+    int n, i;
+
+    larmier_stub(true);
+
+    for (n = 0; n < THREADS; n++) {
+        if (pthread_create(&threads[n], NULL, worker, NULL) != 0) {
+            perror("pthread_create");
+            goto out;
+        }
+    }
+
+    ret = EXIT_SUCCESS;
+
+out:
+    for (i = 0; i < n; i++) {
+        (void)pthread_join(threads[i], NULL);
+    }
+
+    larmier_stub(false);
+
+    fclose(stderr);
+    fclose(stdout);
+    fclose(stdin);
+
+    return ret;
+}
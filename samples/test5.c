@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2019 Nutanix Inc. All rights reserved.
+ *
+ * Author: Felipe Franciosi <felipe@nutanix.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "larmier.h"
+
+// Set up before stubbing, and kept (along with its item) until exit.
+struct container {
+    char *item;
+};
+
+static struct container *container;
+
+int
+main(int argc, char **argv)
+{
+    container = calloc(1, sizeof(*container));
+    if (container == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    larmier_stub(true);
+
+    // Only reachable through the container.
+    container->item = strdup("This is my item");
+    if (container->item == NULL) {
+        perror("strdup");
+    }
+
+    larmier_stub(false);
+
+    (void)fclose(stderr);
+    (void)fclose(stdout);
+    (void)fclose(stdin);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2019 Nutanix Inc. All rights reserved.
+ *
+ * Author: Felipe Franciosi <felipe@nutanix.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "larmier.h"
+
+#define ALLOCS 200
+
+// A long chain of calls, each of which ends the test if it fails, so every
+// path but one fails a single call.
+int
+main(void)
+{
+    char *mem[ALLOCS];
+    int ret = EXIT_FAILURE;
+    int i, n;
+
+    larmier_stub(true);
+
+    for (n = 0; n < ALLOCS; n++) {
+        mem[n] = calloc(1, 16);
+        if (mem[n] == NULL) {
+            perror("calloc");
+            goto out;
+        }
+    }
+
+    ret = EXIT_SUCCESS;
+
+out:
+    larmier_stub(false);
+
+    for (i = 0; i < n; i++) {
+        free(mem[i]);
+    }
+
+    fclose(stderr);
+    fclose(stdout);
+    fclose(stdin);
+
+    return ret;
+}